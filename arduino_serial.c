@@ -1,15 +1,104 @@
 #include "config.h"
+#include "arduino_serial.h"
+#include "handshake.h"
+#include "serial_speed.h"
+#include "stats.h"
+#include "transport.h"
 
+#include <assert.h>
+#include <errno.h>
 #include <termio.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 
+/* The rate the sketch starts at, the link is left at it when closing */
 #ifndef BAUD_RATE
-#define BAUD_RATE B1000000
+#define BAUD_RATE 1000000
 #endif
 
+/*
+ * Extents must fit in the 64 bytes serial buffer of the Arduino, bridges with
+ * native USB report how large theirs can be
+ */
+#define EXTENT_HEADER_SZ 4
+#define EXTENT_MAX_SZ 56
+#define EXTENT_LIMIT_SZ 255
+#define MAX_CREDITS 16
+#define MAX_POSTED_INB 64
+#define WRITE_FAILED 0xff
+#define READ_FAILED 0xff
+#define DIFF_RANGE 0xfe
+
+/* Holds a whole dump, the link never waits for the loader to read it */
+#define RX_RING_SZ (256 << 10)
+#define RX_POLL_MS 10
+
+#define BRIDGE_MAGIC 0x56
+#define CAP_WRITE_EXTENTS	0x0001
+#define CAP_CALIBRATE		0x0002
+#define CAP_ERASE		0x0004
+#define CAP_CHECKSUM		0x0008
+#define CAP_STREAM_ABORT	0x0010
+#define CAP_FAST		0x0020
+#define CAP_BAUD		0x0040
+#define CAP_LOOPBACK		0x0080
+#define CAP_PENTADS		0x0100
+#define CAP_MODULES		0x0200
+#define CAP_DIFF		0x0400
+
+/* Same as in the sketch, a frame of pentads fits in its serial buffer */
+#define MAX_PENTADS 62
+
+/* Stops a read stream, or just sets the data pins to their idle state */
+#define STREAM_ABORT 0x10
+
+/* Modes of the loopback test (0x48) */
+#define LOOPBACK_ECHO 0
+#define LOOPBACK_SINK 1
+#define LOOPBACK_SOURCE 2
+#define LOOPBACK_ROUNDS 200
+#define LOOPBACK_BULK_SZ 0x8000
+
+/* Payloads timed by the link test, around the 60 bytes of the write stream */
+static const uint32_t LOOPBACK_SIZES[] = {1, 8, 16, 32, 60, 64, 128, 256};
+
+/* The bridge gives up on a new rate after that long without the pattern */
+#define BAUD_SETTLE_MS 200
+
+/* Rates tried from the fastest, those of common USB to serial adapters */
+static const uint32_t BAUD_RATES[] = {
+	4000000, 3000000, 2000000, 1500000, 1000000, 500000,
+};
+
+/* Same as in the sketch, bit patterns that break at the wrong rate */
+static const uint8_t BAUD_PATTERN[] = {
+	0x00, 0xff, 0x55, 0xaa, 0x0f, 0xf0, 0x33, 0xcc,
+	0x01, 0x80, 0xfe, 0x7f, 0x5a, 0xa5, 0x3c, 0xc3,
+};
+
+/*
+ * What the bridge reported during the hello handshake, zero if too old. Like
+ * the rest of the state of the link, it is per worker in farm mode.
+ */
+static _Thread_local struct {
+	uint8_t version;
+	uint16_t caps;
+	uint32_t baud_rate;
+	uint16_t rx_buffer_sz;
+	uint8_t window_slots;
+	uint8_t extent_max_sz;
+	uint8_t modules;
+} g_bridge;
+
+/* Modules of the bridge the loader works on, bit n for module n */
+#define MODULES_ALL 0xff
+static _Thread_local uint8_t g_modules;
+
 /*
  * Since only the 6 least significant bits are used by outb we can use the
  * most 2 significant to command the Arduino:
@@ -18,19 +107,278 @@
  *    - 2 : read n bytes
  *    - 3 : write n bytes
  *
+ * inb only needs the command bits so the remaining ones select additional
+ * accelerated functions (0x41: write extents, 0x42: calibrate handshake,
+ * 0x43: set handshake spin time, 0x44: erase, 0x45: checksum, 0x46: fast
+ * mode, 0x47: baud rate, 0x48: loopback test, 0x49: pentads, 0x4a: select
+ * modules, 0x4b: modules status, 0x4c: diff map).
+ *
+ * A read stream can be interrupted by sending STREAM_ABORT while it is still
+ * running. If it was already over the bridge sees it as an outb of the value
+ * the data pins are left with, so there is no need to synchronize.
+ *
+ * Older versions of the sketch treat all of them as inb, so the host starts
+ * with 0x7f (hello): a recent bridge answers with BRIDGE_MAGIC, the size of
+ * the following fields and then its protocol version, the accelerated
+ * functions it supports, its baud rate, serial buffer size, how many frames
+ * it can buffer and how many modules it drives. An old one answers with a
+ * status byte that can't be mistaken for BRIDGE_MAGIC and only the original
+ * commands are used.
+ *
  * See viper_arduino_bridge.ino for more details
  */
 
+/*
+ * Commands are queued and only sent when waiting for a reply or when the queue
+ * is full, so that sequences of outb end up in a single write() (and USB
+ * transfer) instead of one per byte.
+ */
+static _Thread_local uint8_t tx_queue[256];
+static _Thread_local size_t tx_len;
+
+/*
+ * Replies to status reads sent with serial_inb_post(), received ones wait in a
+ * FIFO until serial_inb_fetch() is called.
+ */
+static _Thread_local uint32_t inb_posted;
+static _Thread_local uint8_t inb_replies[MAX_POSTED_INB];
+static _Thread_local uint32_t inb_replies_head, inb_replies_count;
+
+static ssize_t serial_write(const void *data, size_t size)
+{
+	struct timespec start;
+	ssize_t r;
+
+	stats_start(&start);
+	r = write(g_cfg.serial, data, size);
+	g_stats.uart_send_ns += stats_stop(&start);
+	if (r > 0)
+		g_stats.tx_bytes += r;
+	return r;
+}
+
+/*
+ * A thread per device keeps the UART drained into a ring, so replies and read
+ * streams are never held up in the kernel or the adapter while the loader is
+ * busy writing a dump to disk or printing, and reads don't need a syscall.
+ */
+struct serial_rx {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t ready; /* Data arrived or the link is lost */
+	pthread_cond_t space;
+	uint8_t *ring;
+	size_t head, count;
+	int fd;
+	bool stop, lost;
+};
+
+static _Thread_local struct serial_rx *g_rx;
+
+static void *serial_rx_main(void *arg)
+{
+	struct serial_rx *rx = arg;
+	struct pollfd pfd = {
+		.fd = rx->fd,
+		.events = POLLIN,
+	};
+
+	for (;;) {
+		size_t tail, free_sz;
+		bool hangup;
+		ssize_t r;
+
+		r = poll(&pfd, 1, RX_POLL_MS);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r == 0) {
+			if (rx->stop)
+				break;
+			continue;
+		}
+		hangup = r < 0 || pfd.revents & (POLLHUP | POLLERR | POLLNVAL);
+
+		/* The read doesn't block, VMIN and VTIME are 0 */
+		pthread_mutex_lock(&rx->lock);
+		while (rx->count == RX_RING_SZ && !rx->stop)
+			pthread_cond_wait(&rx->space, &rx->lock);
+		tail = (rx->head + rx->count) % RX_RING_SZ;
+		free_sz = RX_RING_SZ - rx->count;
+		if (free_sz > RX_RING_SZ - tail)
+			free_sz = RX_RING_SZ - tail;
+		r = 0;
+		if (pfd.revents & POLLIN && !rx->stop)
+			r = read(rx->fd, &rx->ring[tail], free_sz);
+		if (r > 0) {
+			rx->count += r;
+			pthread_cond_signal(&rx->ready);
+		} else if (hangup
+			   || (r < 0 && errno != EINTR && errno != EAGAIN)) {
+			rx->lost = true;
+			pthread_cond_signal(&rx->ready);
+		}
+		/*
+		 * Otherwise serial_discard() flushed what poll() saw before
+		 * the lock was taken, there is nothing to read anymore
+		 */
+		pthread_mutex_unlock(&rx->lock);
+		if (rx->lost || rx->stop)
+			break;
+	}
+	return NULL;
+}
+
+static int serial_rx_start(void)
+{
+	pthread_condattr_t attr;
+	struct serial_rx *rx = calloc(1, sizeof(*rx));
+
+	if (!rx || !(rx->ring = malloc(RX_RING_SZ))) {
+		free(rx);
+		eprintf("Out of memory\n");
+		return 1;
+	}
+	rx->fd = g_cfg.serial;
+	pthread_mutex_init(&rx->lock, NULL);
+	/* serial_wait_data() timeouts are relative, not wall clock */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&rx->ready, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_cond_init(&rx->space, NULL);
+	if (pthread_create(&rx->thread, NULL, serial_rx_main, rx)) {
+		eprintf("Unable to start the serial receive thread\n");
+		free(rx->ring);
+		free(rx);
+		return 1;
+	}
+	g_rx = rx;
+	return 0;
+}
+
+static void serial_rx_stop(void)
+{
+	struct serial_rx *rx = g_rx;
+
+	if (!rx)
+		return;
+	pthread_mutex_lock(&rx->lock);
+	rx->stop = true;
+	pthread_cond_signal(&rx->space);
+	pthread_mutex_unlock(&rx->lock);
+	pthread_join(rx->thread, NULL);
+	pthread_mutex_destroy(&rx->lock);
+	pthread_cond_destroy(&rx->ready);
+	pthread_cond_destroy(&rx->space);
+	free(rx->ring);
+	free(rx);
+	g_rx = NULL;
+}
+
+/* Throws away what was received, and sent too with TCIOFLUSH */
+static void serial_discard(int queue)
+{
+	pthread_mutex_lock(&g_rx->lock);
+	tcflush(g_cfg.serial, queue);
+	g_rx->head = g_rx->count = 0;
+	pthread_mutex_unlock(&g_rx->lock);
+}
+
+/* Only called once serial_wait_data() said there is something to read */
+static ssize_t serial_read(void *data, size_t size)
+{
+	struct serial_rx *rx = g_rx;
+	size_t n, first;
+
+	pthread_mutex_lock(&rx->lock);
+	n = size < rx->count ? size : rx->count;
+	first = n < RX_RING_SZ - rx->head ? n : RX_RING_SZ - rx->head;
+	memcpy(data, &rx->ring[rx->head], first);
+	memcpy((uint8_t *) data + first, rx->ring, n - first);
+	if (rx->count == RX_RING_SZ && n)
+		pthread_cond_signal(&rx->space);
+	rx->head = (rx->head + n) % RX_RING_SZ;
+	rx->count -= n;
+	pthread_mutex_unlock(&rx->lock);
+	g_stats.rx_bytes += n;
+	return n;
+}
+
+static int serial_flush(void)
+{
+	size_t sent = 0;
+
+	while (sent < tx_len) {
+		ssize_t r = serial_write(&tx_queue[sent], tx_len - sent);
+
+		if (r <= 0) {
+			tx_len = 0;
+			return 1;
+		}
+		sent += r;
+	}
+	tx_len = 0;
+	return 0;
+}
+
+/*
+ * Only sees the queue of the main thread, for a single device that exits
+ * without closing it. Farm and daemon threads flush in serial_close().
+ */
+static void serial_flush_at_exit(void)
+{
+	if (serial_flush())
+		perror("Serial write failure");
+}
+
+static void serial_register_exit(void)
+{
+	atexit(serial_flush_at_exit);
+}
+
+static ssize_t serial_send(const void *data, size_t size)
+{
+	if (tx_len + size > sizeof(tx_queue) && serial_flush())
+		return -1;
+	if (size > sizeof(tx_queue))
+		return serial_write(data, size);
+	memcpy(&tx_queue[tx_len], data, size);
+	tx_len += size;
+	return size;
+}
+
 static int serial_wait_data(const struct timeval *timeout, bool silent_timeout)
 {
-	struct timeval to = (timeout) ? *timeout : g_cfg.timeout;
-	int r;
+	const struct timeval *to = (timeout) ? timeout : &g_cfg.timeout;
+	struct serial_rx *rx = g_rx;
+	struct timespec start, deadline;
+	bool available, lost;
+
+	if (serial_flush()) {
+		perror("Serial write failure");
+		return -1;
+	}
 
-	r = select(g_cfg.serial + 1, &g_cfg.serial_s, NULL, NULL, &to);
-	if (r == -1) {
-		perror("Select error");
+	stats_start(&start);
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += to->tv_sec + (deadline.tv_nsec / 1000
+					 + to->tv_usec) / 1000000;
+	deadline.tv_nsec = (deadline.tv_nsec / 1000 + to->tv_usec) % 1000000
+		* 1000 + deadline.tv_nsec % 1000;
+	pthread_mutex_lock(&rx->lock);
+	while (rx->count == 0 && !rx->lost
+	       && pthread_cond_timedwait(&rx->ready, &rx->lock, &deadline) == 0)
+		;
+	available = rx->count != 0;
+	lost = rx->lost;
+	pthread_mutex_unlock(&rx->lock);
+	g_stats.uart_wait_ns += stats_stop(&start);
+	++g_stats.uart_waits;
+	if (!available && lost) {
+		eprintf("\nLost the serial device\n");
 		return -1;
-	} else if (r == 0) {
+	} else if (!available) {
+		++g_stats.uart_timeouts;
 		if (!silent_timeout)
 			eprintf("\nArduino timed out\n");
 		return -2;
@@ -38,16 +386,183 @@ static int serial_wait_data(const struct timeval *timeout, bool silent_timeout)
 	return 0;
 }
 
-static int serial_try_init(bool first_run)
+static uint16_t get_u16(const uint8_t *b)
+{
+	return (uint16_t) b[0] << 8 | b[1];
+}
+
+static uint32_t get_u24(const uint8_t *b)
+{
+	return (uint32_t) b[0] << 16 | get_u16(&b[1]);
+}
+
+static uint32_t get_u32(const uint8_t *b)
+{
+	return (uint32_t) get_u16(b) << 16 | get_u16(&b[2]);
+}
+
+/* Receives the fixed size reply of an accelerated function */
+static int serial_read_reply(uint8_t *reply, uint32_t size,
+			     const struct timeval *timeout)
+{
+	uint32_t received = 0;
+
+	while (received < size) {
+		int r;
+
+		if (serial_wait_data(timeout, false))
+			return 1;
+		r = serial_read(&reply[received], size - received);
+		if (r <= 0) {
+			eprintf("Serial read failure %u\n", __LINE__);
+			return 1;
+		}
+		received += r;
+	}
+	return 0;
+}
+
+static int serial_handshake(void)
+{
+	uint8_t hello = 0x7f;
+	uint8_t reply[255] = {0};
+	uint8_t size;
+
+	memset(&g_bridge, 0, sizeof(g_bridge));
+	if (serial_send(&hello, 1) <= 0) {
+		perror("Serial write failure");
+		return 1;
+	}
+	if (serial_read_reply(reply, 1, NULL))
+		return 1;
+	if (reply[0] != BRIDGE_MAGIC)
+		return 0; /* Status byte, legacy firmware */
+	if (serial_read_reply(&size, 1, NULL)
+	    || serial_read_reply(reply, size, NULL))
+		return 1;
+
+	/* Fields are only ever appended, ignore the ones we don't know */
+	g_bridge.version = reply[0];
+	g_bridge.caps = get_u16(&reply[1]) & ~g_cfg.disabled_caps;
+	g_bridge.baud_rate = get_u32(&reply[3]);
+	g_bridge.rx_buffer_sz = get_u16(&reply[7]);
+	g_bridge.window_slots = reply[9];
+	g_bridge.extent_max_sz = reply[10] ? reply[10] : EXTENT_MAX_SZ;
+	g_bridge.modules = reply[11] ? reply[11] : 1;
+	return 0;
+}
+
+/* Returns how many bytes arrived before the link stayed quiet for timeout */
+static uint32_t serial_read_quiet(uint8_t *data, uint32_t size,
+				  const struct timeval *timeout)
+{
+	uint32_t received = 0;
+
+	while (received < size && serial_wait_data(timeout, true) == 0) {
+		int r = serial_read(&data[received], size - received);
+
+		if (r <= 0)
+			break;
+		received += r;
+	}
+	return received;
+}
+
+/*
+ * The bridge switches to rate after acknowledging it, then echoes the test
+ * pattern and waits for the switch to be committed with another 0x47 (ACKed
+ * with 1). Returns 0 once both sides use rate, 1 if they stayed at the
+ * previous one and -1 if the link is lost.
+ */
+static int serial_try_baud(uint32_t rate)
+{
+	static const struct timeval SETTLE = {.tv_usec = BAUD_SETTLE_MS * 1000};
+	uint8_t cmd[5] = {0x47, rate >> 24, rate >> 16, rate >> 8, rate};
+	uint8_t reply, echo[sizeof(BAUD_PATTERN)];
+
+	if (serial_send(cmd, sizeof(cmd)) <= 0
+	    || serial_read_reply(&reply, 1, NULL))
+		return -1;
+	if (reply == 0)
+		return 1; /* Can't be generated by the bridge */
+
+	if (serial_set_speed(g_cfg.serial, rate) == 0) {
+		/* The bridge switches once its reply is sent */
+		usleep(2000);
+		serial_send(BAUD_PATTERN, sizeof(BAUD_PATTERN));
+		if (serial_read_quiet(echo, sizeof(echo), &SETTLE) == sizeof(echo)
+		    && memcmp(echo, BAUD_PATTERN, sizeof(echo)) == 0
+		    && serial_send(cmd, 1) == 1
+		    && serial_read_quiet(&reply, 1, &SETTLE) == 1
+		    && reply == 1) {
+			g_bridge.baud_rate = rate;
+			return 0;
+		}
+	}
+
+	/* The bridge goes back to the previous rate once the link is quiet */
+	if (serial_set_speed(g_cfg.serial, g_bridge.baud_rate))
+		return -1;
+	usleep(2 * BAUD_SETTLE_MS * 1000);
+	serial_discard(TCIOFLUSH);
+	return 1;
+}
+
+/* Steps up to the fastest rate both sides get through intact */
+static int serial_negotiate_baud(void)
+{
+	if (!(g_bridge.caps & CAP_BAUD))
+		return 0;
+	for (size_t i = 0; i < sizeof(BAUD_RATES) / sizeof(BAUD_RATES[0]); ++i) {
+		int r;
+
+		if (BAUD_RATES[i] <= g_bridge.baud_rate
+		    || BAUD_RATES[i] > g_cfg.max_baud)
+			continue;
+		r = serial_try_baud(BAUD_RATES[i]);
+		if (r <= 0)
+			return r;
+	}
+	return 0;
+}
+
+/*
+ * A loader that didn't get to close the device left the bridge at the rate
+ * it negotiated, a Nano doesn't reset when the device is opened again if its
+ * DTR line isn't wired. Returns like serial_wait_data().
+ */
+static int serial_ping_other_rates(void)
+{
+	static const struct timeval SETTLE = {.tv_usec = BAUD_SETTLE_MS * 1000};
+	uint8_t ping = 0x40; /* inb */
+
+	for (size_t i = 0; i < sizeof(BAUD_RATES) / sizeof(BAUD_RATES[0]); ++i) {
+		int r;
+
+		if (BAUD_RATES[i] == BAUD_RATE)
+			continue;
+		if (serial_set_speed(g_cfg.serial, BAUD_RATES[i]))
+			return -1;
+		serial_discard(TCIOFLUSH);
+		serial_send(&ping, 1);
+		r = serial_wait_data(&SETTLE, true);
+		if (r != -2)
+			return r;
+	}
+	return -2;
+}
+
+static int serial_try_init(const char *path, bool first_run)
 {
 	struct termios tty;
 	unsigned char ping = 0x40; /* inb */
 	int r = 0;
 
-	g_cfg.serial = open(g_cfg.serial_dev, O_RDWR);
+	g_cfg.serial = open(path, O_RDWR);
 	if (g_cfg.serial == -1) {
-		perror("Failed to open serial device, make sure to give your "
-		       "user access to the device or run as root\n");
+		eprintf("Failed to open serial device: %s, make sure to give "
+			"your user access to the device or run as root\n",
+			strerror(errno));
 		return 1;
 	}
 	if (tcgetattr(g_cfg.serial, &tty) == -1) {
@@ -55,12 +570,6 @@ static int serial_try_init(bool first_run)
 		return 1;
 	}
 
-	if (cfsetspeed(&tty, BAUD_RATE) == -1) {
-		perror("Failed to set baud rate\n");
-		close(g_cfg.serial);
-		return 1;
-	}
-
 	tty.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR |
 			 ICRNL | IXON | IXOFF);
 	tty.c_oflag &= ~OPOST;
@@ -72,35 +581,219 @@ static int serial_try_init(bool first_run)
 
 	if (tcsetattr (g_cfg.serial, TCSANOW, &tty) != 0) {
 		perror("Error configuring serial interface\n");
-		close(g_cfg.serial);
 		return 1;
 	}
+	if (serial_set_speed(g_cfg.serial, BAUD_RATE)) {
+		perror("Failed to set baud rate");
+		return 1;
+	}
+	if (serial_rx_start())
+		return 1;
 
-	FD_ZERO(&g_cfg.serial_s);
-	FD_SET(g_cfg.serial, &g_cfg.serial_s);
-
-	write(g_cfg.serial, &ping, 1);
-	r = serial_wait_data(NULL, first_run);
+	serial_send(&ping, 1);
+	r = serial_wait_data(NULL, true);
+	/* The Arduino had the time to boot, it may still be at another rate */
+	if (r == -2 && !first_run)
+		r = serial_ping_other_rates();
+	if (r == -2 && !first_run)
+		eprintf("\nArduino timed out\n");
 	if (r != 0)
 		return -r;
-	tcflush(g_cfg.serial, TCIOFLUSH);
+	serial_discard(TCIOFLUSH);
+
+	if (serial_handshake())
+		return 1;
+	if (serial_negotiate_baud()) {
+		eprintf("Lost the bridge while changing the baud rate\n");
+		return 1;
+	}
+	if (g_bridge.version && g_bridge.baud_rate == 0)
+		printf("Ready, bridge v%u over native USB, %u bytes buffer, "
+		       "%u frames window of %u bytes\n", g_bridge.version,
+		       g_bridge.rx_buffer_sz, g_bridge.window_slots,
+		       g_bridge.extent_max_sz);
+	else if (g_bridge.version)
+		printf("Ready, bridge v%u at %u bauds, %u bytes buffer, "
+		       "%u frames window of %u bytes\n", g_bridge.version,
+		       g_bridge.baud_rate, g_bridge.rx_buffer_sz,
+		       g_bridge.window_slots, g_bridge.extent_max_sz);
+	else
+		printf("Ready, legacy bridge firmware\n");
+	return 0;
+}
+
+/* Stops receiving and closes the device, whatever was set up */
+static void serial_release(void)
+{
+	serial_rx_stop();
+	if (g_cfg.serial != -1)
+		close(g_cfg.serial);
+	g_cfg.serial = -1;
+}
+
+/*
+ * dev@0,2 or dev@all works on several modules of a Mega bridge at once, dev
+ * alone on module 0. Strips the suffix from path and returns the mask of the
+ * modules, 0 if it is invalid.
+ */
+static uint8_t serial_parse_modules(char *path)
+{
+	char *spec = strrchr(path, '@');
+	uint8_t mask = 0;
 
-	printf("Ready\n");
+	if (!spec)
+		return 1;
+	*spec++ = '\0';
+	if (strcmp(spec, "all") == 0)
+		return MODULES_ALL;
+	do {
+		char *end;
+		unsigned long m = strtoul(spec, &end, 10);
+
+		if (end == spec || m >= 8)
+			return 0;
+		mask |= 1 << m;
+		spec = end;
+	} while (*spec++ == ',');
+	return spec[-1] == '\0' ? mask : 0;
+}
+
+/* Sends the next commands to the modules of mask */
+static int serial_select(uint8_t mask)
+{
+	uint8_t cmd[2] = {0x4a, mask};
+	uint8_t reply;
+
+	if (serial_send(cmd, sizeof(cmd)) <= 0) {
+		perror("Serial write failure");
+		return 1;
+	}
+	if (serial_read_reply(&reply, 1, NULL))
+		return 1;
+	if (reply != mask) {
+		fflush(stdout);
+		eprintf("The bridge only has modules 0 to %u\n",
+			g_bridge.modules - 1);
+		return 1;
+	}
+	g_modules = mask;
+	return 0;
+}
+
+static int serial_select_modules(uint8_t mask)
+{
+	/* Other bridges only drive module 0 */
+	if (!(g_bridge.caps & CAP_MODULES) || g_bridge.modules == 1) {
+		g_modules = 1;
+		if (mask == 1 || mask == MODULES_ALL)
+			return 0;
+		fflush(stdout);
+		eprintf("The bridge drives a single module\n");
+		return 1;
+	}
+	if (mask == MODULES_ALL)
+		mask = (1 << g_bridge.modules) - 1;
+	if (serial_select(mask))
+		return 1;
+	if (g_bridge.modules > 1)
+		printf("Using %u of the %u modules of the bridge\n",
+		       serial_module_count(), g_bridge.modules);
 	return 0;
 }
 
 int serial_init(void)
 {
+	static pthread_once_t exit_once = PTHREAD_ONCE_INIT;
+	char path[sizeof(g_cfg.serial_dev)];
+	uint8_t modules;
 	int r;
 
+	strcpy(path, g_cfg.serial_dev);
+	modules = serial_parse_modules(path);
+	if (modules == 0) {
+		eprintf("Invalid modules in '%s', expected dev@n[,n]... or "
+			"dev@all\n", g_cfg.serial_dev);
+		return 1;
+	}
 	printf("Initializing serial interface %s... ", g_cfg.serial_dev);
 	fflush(stdout);
-	r = serial_try_init(true);
-	if (r == 0 || r == 1)
-		return r;
+	pthread_once(&exit_once, serial_register_exit);
+	r = serial_try_init(path, true);
 	if (r == 2) {
+		/* Opening the device may have reset the Arduino */
+		serial_release();
 		usleep(1000000);
-		return serial_try_init(false);
+		r = serial_try_init(path, false);
+	}
+	if (r == 0 && serial_select_modules(modules))
+		r = 1;
+	if (r != 0)
+		serial_release();
+	return r != 0;
+}
+
+unsigned int serial_module_count(void)
+{
+	unsigned int count = 0;
+
+	for (uint8_t mask = g_modules; mask; mask >>= 1)
+		count += mask & 1;
+	return count;
+}
+
+/*
+ * Only the first selected module answers what reads the chip, each of them
+ * is selected alone in turn for op
+ */
+int serial_for_each_module(int (*op)(void))
+{
+	uint8_t selected = g_modules;
+	int r = 0;
+
+	if (serial_module_count() < 2)
+		return op();
+	for (unsigned int m = 0; m < 8; ++m) {
+		if (!(selected & 1 << m))
+			continue;
+		printf("Module %u:\n", m);
+		if (serial_select(1 << m))
+			return 1;
+		r |= op();
+	}
+	return serial_select(selected) || r;
+}
+
+/*
+ * The other modules keep programming when one of them fails, where each one
+ * stopped is only known once the extents are done
+ */
+static int serial_modules_failed(int r, uint32_t *failed_at)
+{
+	uint8_t cmd = 0x4b;
+	uint8_t failed, at[3];
+
+	if (serial_send(&cmd, 1) <= 0) {
+		perror("Serial write failure");
+		return 1;
+	}
+	if (serial_read_reply(&failed, 1, NULL))
+		return 1;
+	if (failed == 0)
+		return r;
+	fflush(stdout);
+	*failed_at = BIOS_SIZE;
+	for (unsigned int m = 0; m < 8; ++m) {
+		uint32_t address;
+
+		if (!(failed & 1 << m))
+			continue;
+		if (serial_read_reply(at, sizeof(at), NULL))
+			return 1;
+		address = (uint32_t) at[0] << 16 | get_u16(&at[1]);
+		eprintf("\nModule %u failed to program address 0x%05x\n", m,
+			address);
+		if (address < *failed_at)
+			*failed_at = address;
 	}
 	return 1;
 }
@@ -109,53 +802,156 @@ void serial_outb(uint8_t data)
 {
 	unsigned char cmd = data & 0x3f;
 
-	if (write(g_cfg.serial, &cmd, 1) <= 0) {
+	if (serial_send(&cmd, 1) <= 0) {
 		perror("Serial write failure");
 	}
 }
 
+static int serial_receive_posted(void)
+{
+	while (inb_posted) {
+		uint8_t replies[MAX_POSTED_INB];
+		int r;
+
+		if (serial_wait_data(NULL, false))
+			return 1;
+		r = serial_read(replies, inb_posted);
+		if (r <= 0) {
+			eprintf("Serial read failure %u\n", __LINE__);
+			return 1;
+		}
+		for (int i = 0; i < r; ++i) {
+			inb_replies[(inb_replies_head + inb_replies_count)
+				    % MAX_POSTED_INB] = replies[i];
+			++inb_replies_count;
+		}
+		inb_posted -= r;
+	}
+	return 0;
+}
+
 uint8_t serial_inb(void)
 {
 	uint8_t data = 0xff;
 	uint8_t cmd = 0x40;
 
-	if (write(g_cfg.serial, &cmd, 1) <= 0) {
+	if (serial_send(&cmd, 1) <= 0) {
 		perror("Serial write failure");
 		return 1;
 	}
 
+	/* Replies to posted status reads come first */
+	if (serial_receive_posted())
+		return 1;
 	if (serial_wait_data(NULL, false))
 		return 1;
-	if (read(g_cfg.serial, &data, 1) != 1) {
+	if (serial_read(&data, 1) != 1) {
 		eprintf("Serial read failure %u\n", __LINE__);
 		return 1;
 	}
 	return data;
 }
 
-uint8_t serial_read_byte_stream(uint8_t *bios_buffer, uint32_t max)
+/*
+ * The sketch runs outp() on every pentad, ACKs included, and only answers
+ * once for the frame
+ */
+int serial_pentads(const uint8_t *data, uint8_t count)
 {
-	uint8_t read_cmd[3];
+	uint8_t frame[2 + MAX_PENTADS] = {0x49};
+	uint8_t status;
 
-	read_cmd[0] = 0x80 | max >> 16;
-	read_cmd[1] = (max >> 8) & 0xff;
-	read_cmd[2] = max & 0xff;
-	if (write(g_cfg.serial, &read_cmd, 3) <= 0) {
-		perror("Serial write failure");
+	if (!(g_bridge.caps & CAP_PENTADS))
+		return -1;
+	/* Replies to the status reads posted before come first */
+	if (serial_receive_posted())
 		return 1;
-	}
+	for (uint8_t sent = 0; sent < count; ) {
+		uint8_t n = count - sent < MAX_PENTADS ? count - sent
+						      : MAX_PENTADS;
 
-	for (uint32_t i = 0; i < max; ) {
-		if (serial_wait_data(NULL, false))
+		frame[1] = n;
+		for (uint8_t i = 0; i < n; ++i)
+			frame[2 + i] = data[sent + i] & 0x1f;
+		if (serial_send(frame, 2 + n) <= 0) {
+			perror("Serial write failure");
 			return 1;
-
-		i += read(g_cfg.serial, &bios_buffer[i], max - i);
-		printf("\rReceived %06u/%06u bytes", i, max);
+		}
+		if (serial_read_reply(&status, 1, NULL))
+			return 1;
+		/* The mask of the modules that missed an ACK */
+		for (unsigned int m = 0; m < 8 && serial_module_count() > 1; ++m) {
+			if (status & 1 << m)
+				eprintf("Module %u didn't ACK\n", m);
+		}
+		if (status)
+			return 1;
+		sent += n;
 	}
 	return 0;
 }
 
-int serial_write_byte_stream(uint8_t *data, uint32_t data_sz)
+/*
+ * Queue a status read, its result is given by serial_inb_fetch(). Receiving
+ * the replies wouldn't make room, the results stay until they are fetched.
+ */
+void serial_inb_post(void)
+{
+	uint8_t cmd = 0x40;
+
+	assert(inb_posted + inb_replies_count < MAX_POSTED_INB);
+	if (serial_send(&cmd, 1) <= 0) {
+		perror("Serial write failure");
+		return;
+	}
+	++inb_posted;
+}
+
+uint8_t serial_inb_fetch(void)
+{
+	uint8_t data;
+
+	if (inb_replies_count == 0 && serial_receive_posted())
+		return 1;
+	if (inb_replies_count == 0)
+		return 1;
+	data = inb_replies[inb_replies_head];
+	inb_replies_head = (inb_replies_head + 1) % MAX_POSTED_INB;
+	--inb_replies_count;
+	return data;
+}
+
+int serial_read_byte_stream(uint8_t *bios_buffer, uint32_t max)
+{
+	uint8_t read_cmd[3];
+
+	read_cmd[0] = 0x80 | max >> 16;
+	read_cmd[1] = (max >> 8) & 0xff;
+	read_cmd[2] = max & 0xff;
+	if (serial_send(&read_cmd, 3) <= 0) {
+		perror("Serial write failure");
+		return 1;
+	}
+
+	for (uint32_t i = 0; i < max; ) {
+		int r;
+
+		if (serial_wait_data(NULL, false))
+			return 1;
+		r = serial_read(&bios_buffer[i], max - i);
+		if (r <= 0) {
+			eprintf("Serial read failure %u\n", __LINE__);
+			return 1;
+		}
+		i += r;
+		dump_progress(bios_buffer, i);
+		print_progress(i, max);
+	}
+	return 0;
+}
+
+int serial_write_byte_stream(const uint8_t *data, uint32_t data_sz,
+			     uint32_t *failed_at)
 {
 	uint8_t write_cmd[3];
 	uint8_t ack = 0x69;
@@ -168,7 +964,7 @@ int serial_write_byte_stream(uint8_t *data, uint32_t data_sz)
 	write_cmd[1] = (data_sz >> 8) & 0xff;
 	write_cmd[2] = data_sz & 0xff;
 
-	if (write(g_cfg.serial, &write_cmd, 3) <= 0) {
+	if (serial_send(&write_cmd, 3) <= 0) {
 		perror("Serial write failure");
 		return 1;
 	}
@@ -177,7 +973,11 @@ int serial_write_byte_stream(uint8_t *data, uint32_t data_sz)
 		uint32_t left = data_sz - i;
 
 		uint32_t write_sz = left < 60 ? left : 60;
-		if (write(g_cfg.serial, &data[i], write_sz) <= 0) {
+
+		/* The Arduino programs a chunk after acknowledging it */
+		*failed_at = i < 60 ? 0 : i - 60;
+		++g_stats.frames;
+		if (serial_send(&data[i], write_sz) <= 0) {
 			perror("Serial write failure");
 			return 1;
 		}
@@ -185,20 +985,698 @@ int serial_write_byte_stream(uint8_t *data, uint32_t data_sz)
 		if (left < 60) {
 			uint8_t padding[59] = {0};
 
-			write(g_cfg.serial, padding, 60 - left);
+			serial_send(padding, 60 - left);
 		}
 
 		if (serial_wait_data(&timeout, false))
 			return 1;
-		r = read(g_cfg.serial, &ack, 1);
+		r = serial_read(&ack, 1);
 		if (r != 1 || ack != 60) {
 			eprintf("Serial read failure r=%d %u %02x\n", r,
 				__LINE__, ack);
 			return 1;
 		}
-		printf("\rWritten %06u/%06u bytes", i + write_sz, data_sz);
+		print_progress(i + write_sz, data_sz);
+	}
+	return 0;
+}
+
+/*
+ * Find the next run of non blank bytes starting at *start, short blank gaps
+ * cost less to program than a new extent header so they are kept.
+ * Returns the size of the extent, 0 if there is nothing left to write.
+ */
+static uint32_t next_extent(const uint8_t *data, uint32_t data_sz,
+			    uint32_t *start)
+{
+	uint32_t end, last;
+
+	while (*start < data_sz && data[*start] == 0xff)
+		++*start;
+	if (*start == data_sz)
+		return 0;
+
+	last = *start;
+	for (end = *start + 1; end < data_sz; ++end) {
+		if (end - *start == g_bridge.extent_max_sz)
+			break;
+		if (data[end] != 0xff)
+			last = end;
+		else if (end - last >= EXTENT_HEADER_SZ)
+			break;
+	}
+	return last - *start + 1;
+}
+
+static int send_extent(const uint8_t *data, uint32_t offset, uint32_t start,
+		       uint32_t size)
+{
+	uint8_t frame[EXTENT_HEADER_SZ + EXTENT_LIMIT_SZ];
+	uint32_t address = offset + start;
+
+	frame[0] = address >> 16;
+	frame[1] = (address >> 8) & 0xff;
+	frame[2] = address & 0xff;
+	frame[3] = size;
+	memcpy(&frame[EXTENT_HEADER_SZ], &data[start], size);
+	++g_stats.frames;
+	if (serial_send(frame, EXTENT_HEADER_SZ + size) <= 0) {
+		perror("Serial write failure");
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * The Arduino reported the address it failed to program and ignores the frames
+ * still in flight, end the list and wait for it to be done
+ */
+static int serial_extents_failed(const uint8_t *received, int received_sz,
+				 bool last_sent, uint32_t *failed_at)
+{
+	uint8_t end[EXTENT_HEADER_SZ] = {0};
+	uint8_t reply[4] = {0}; /* Failing address and the last credit */
+	int have = received_sz < 4 ? received_sz : 4;
+	struct timeval timeout = {
+		.tv_sec = 5,
+	};
+
+	memcpy(reply, received, have);
+	if (!last_sent && serial_send(end, sizeof(end)) <= 0) {
+		perror("Serial write failure");
+		return 1;
+	}
+	if (serial_read_reply(&reply[have], sizeof(reply) - have, &timeout))
+		return 1;
+	*failed_at = (uint32_t) reply[0] << 16 | get_u16(&reply[1]);
+	fflush(stdout);
+	eprintf("\nArduino failed to program address 0x%05x\n", *failed_at);
+	return 1;
+}
+
+/*
+ * The Arduino advertises how many frames it can buffer, keep that many in
+ * flight so that the next frames are already there when it's done programming
+ * the current one. Credits come back in order, one per programmed frame.
+ */
+int serial_write_extents(const uint8_t *data, uint32_t offset,
+			 uint32_t data_sz, uint32_t *failed_at)
+{
+	uint8_t cmd = 0x41;
+	uint8_t acks[MAX_CREDITS];
+	uint32_t inflight[MAX_CREDITS]; /* Start of the frames in flight */
+	uint8_t inflight_sz[MAX_CREDITS];
+	uint8_t credits = 0, head = 0, count = 0;
+	uint32_t start = 0, done = 0;
+	bool last_sent = false;
+	int r;
+	struct timeval timeout = {
+		.tv_sec = 5,
+	};
+
+	*failed_at = offset;
+	if (serial_send(&cmd, 1) <= 0) {
+		perror("Serial write failure");
+		return 1;
+	}
+	if (serial_wait_data(&timeout, false))
+		return 1;
+	if (serial_read(&credits, 1) != 1 || credits == 0) {
+		eprintf("Serial read failure %u\n", __LINE__);
+		return 1;
+	}
+	if (credits > MAX_CREDITS)
+		credits = MAX_CREDITS;
+
+	for (;;) {
+		while (credits && !last_sent) {
+			uint8_t slot = (head + count) % MAX_CREDITS;
+			uint32_t size = next_extent(data, data_sz, &start);
+
+			if (send_extent(data, offset, start, size))
+				return 1;
+			inflight[slot] = start;
+			inflight_sz[slot] = size;
+			++count;
+			--credits;
+			start += size;
+			last_sent = size == 0;
+		}
+
+		/* The bridge programs slower than the link can feed it */
+		if (!last_sent)
+			++g_stats.credit_stalls;
+		if (serial_wait_data(&timeout, false))
+			return 1;
+		r = serial_read(acks, count);
+		if (r <= 0) {
+			eprintf("Serial read failure %u\n", __LINE__);
+			return 1;
+		}
+		for (int i = 0; i < r; ++i) {
+			if (acks[i] == WRITE_FAILED)
+				return serial_extents_failed(&acks[i + 1],
+							     r - i - 1,
+							     last_sent,
+							     failed_at);
+			if (acks[i] != inflight_sz[head]) {
+				eprintf("Serial read failure %u %02x\n",
+					__LINE__, acks[i]);
+				return 1;
+			}
+			if (acks[i] == 0) {
+				print_progress(data_sz, data_sz);
+				return 0;
+			}
+			/* Blank gaps between extents need no programming */
+			done = inflight[head] + inflight_sz[head];
+			*failed_at = offset + done;
+			head = (head + 1) % MAX_CREDITS;
+			--count;
+			++credits;
+		}
+		print_progress(done, data_sz);
+	}
+}
+
+/* Let the Arduino measure ACK latencies, it times the chip much closer */
+int serial_calibrate(struct ack_stats *stats)
+{
+	uint8_t cmd = 0x42;
+	uint8_t reply[9];
+
+	if (!(g_bridge.caps & CAP_CALIBRATE))
+		return -1;
+
+	if (serial_send(&cmd, 1) <= 0) {
+		perror("Serial write failure");
+		return 1;
+	}
+	if (serial_read_reply(reply, sizeof(reply), NULL) || reply[0] != 0)
+		return 1;
+
+	stats->p50_ns = get_u16(&reply[1]) * 1000;
+	stats->p99_ns = get_u16(&reply[3]) * 1000;
+	stats->max_ns = get_u16(&reply[5]) * 1000;
+	stats->spin_us = get_u16(&reply[7]);
+	return 0;
+}
+
+int serial_set_spin(uint32_t spin_us)
+{
+	uint8_t cmd[3];
+
+	if (!(g_bridge.caps & CAP_CALIBRATE))
+		return 0;
+	if (spin_us > 0xffff)
+		spin_us = 0xffff;
+	cmd[0] = 0x43;
+	cmd[1] = spin_us >> 8;
+	cmd[2] = spin_us & 0xff;
+	if (serial_send(cmd, sizeof(cmd)) <= 0) {
+		perror("Serial write failure");
+		return 1;
+	}
+	return 0;
+}
+
+/* The Arduino erases the chip and polls for completion on its own */
+int serial_erase(uint32_t *elapsed_ms)
+{
+	uint8_t cmd = 0x44;
+	uint8_t reply[3];
+	struct timeval timeout = {
+		.tv_sec = 35,
+	};
+
+	if (!(g_bridge.caps & CAP_ERASE))
+		return erase_and_wait(&serial_transport.io, elapsed_ms);
+	if (serial_send(&cmd, 1) <= 0) {
+		perror("Serial write failure");
+		return 1;
+	}
+	if (serial_read_reply(reply, sizeof(reply), &timeout))
+		return 1;
+	*elapsed_ms = get_u16(&reply[1]);
+	return reply[0];
+}
+
+static void serial_close(void)
+{
+	/* The next run starts at BAUD_RATE, whether the Arduino resets or not */
+	if (g_bridge.caps & CAP_BAUD && g_bridge.baud_rate != BAUD_RATE
+	    && serial_try_baud(BAUD_RATE))
+		eprintf("Couldn't set the bridge back to %u bauds\n",
+			BAUD_RATE);
+	if (serial_flush())
+		perror("Serial write failure");
+	/* Don't leave the last commands in the kernel when the device closes */
+	tcdrain(g_cfg.serial);
+	serial_release();
+}
+
+/* The Arduino paces pentads with the handshake spin time it calibrated */
+static int serial_set_fast(bool fast)
+{
+	uint8_t cmd[2] = {0x46, fast};
+
+	if (!(g_bridge.caps & CAP_FAST))
+		return 1;
+	if (serial_send(cmd, sizeof(cmd)) <= 0) {
+		perror("Serial write failure");
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * The Arduino reads the chip and only sends back a status byte and the CRC32
+ * of each block
+ */
+static int serial_checksum_range(uint32_t size, uint32_t block_sz,
+				 uint32_t *crcs)
+{
+	uint8_t cmd[5];
+	uint8_t reply[5];
+	uint32_t blocks;
+	struct timeval timeout = {
+		.tv_sec = 5,
+	};
+
+	if (!(g_bridge.caps & CAP_CHECKSUM))
+		return -1;
+	if (block_sz == 0)
+		block_sz = size;
+	/* Block size is sent in units of 256 bytes */
+	if (block_sz % 256 || block_sz / 256 > 0xff)
+		return 1;
+	blocks = (size + block_sz - 1) / block_sz;
+
+	cmd[0] = 0x45;
+	cmd[1] = size >> 16;
+	cmd[2] = (size >> 8) & 0xff;
+	cmd[3] = size & 0xff;
+	cmd[4] = block_sz == size ? 0 : block_sz / 256;
+	if (serial_send(cmd, sizeof(cmd)) <= 0) {
+		perror("Serial write failure");
+		return 1;
+	}
+	for (uint32_t b = 0; b < blocks; ++b) {
+		if (serial_read_reply(reply, sizeof(reply), &timeout))
+			return 1;
+		if (reply[0] != 0)
+			return 1;
+		crcs[b] = get_u32(&reply[1]);
+		print_progress(b + 1 == blocks ? size : (b + 1) * block_sz,
+			       size);
+	}
+	return 0;
+}
+
+static int serial_write_range(const uint8_t *data, uint32_t offset,
+			      uint32_t size, uint32_t *failed_at)
+{
+	if (g_bridge.caps & CAP_WRITE_EXTENTS) {
+		int r = serial_write_extents(data, offset, size, failed_at);
+
+		if (serial_module_count() > 1)
+			return serial_modules_failed(r, failed_at);
+		return r;
+	}
+	if (offset == 0)
+		return serial_write_byte_stream(data, size, failed_at);
+
+	/* The byte stream of old bridges always starts at address 0 */
+	for (uint32_t i = 0; i < size; ++i) {
+		if (write_byte(&serial_transport.io, data[i], offset + i)) {
+			eprintf("\nError while writing to the chip. "
+				"@0x%05x <- 0x%02x\n", offset + i, data[i]);
+			*failed_at = offset + i;
+			return 1;
+		}
+		print_progress(i + 1, size);
+	}
+	return 0;
+}
+
+/* Discards what the bridge sent after a stream was aborted */
+static void serial_drain(void)
+{
+	struct timeval timeout = {
+		.tv_usec = 100000,
+	};
+	uint8_t discard[256];
+
+	while (serial_wait_data(&timeout, true) == 0) {
+		if (serial_read(discard, sizeof(discard)) <= 0)
+			break;
+	}
+}
+
+/*
+ * Compares the data as it is received, the stream is aborted as soon as enough
+ * differences have been found instead of waiting for the end of the dump
+ */
+static int serial_verify_range(const uint8_t *expect, uint32_t size,
+			       uint32_t max_diffs, uint32_t *first_diff,
+			       uint32_t *diffs)
+{
+	uint8_t read_cmd[3];
+	uint8_t abort_cmd = STREAM_ABORT;
+	uint8_t actual[256];
+	bool done = false;
+
+	*first_diff = size;
+	*diffs = 0;
+
+	read_cmd[0] = 0x80 | size >> 16;
+	read_cmd[1] = (size >> 8) & 0xff;
+	read_cmd[2] = size & 0xff;
+	if (serial_send(&read_cmd, 3) <= 0) {
+		perror("Serial write failure");
+		return 1;
 	}
 
-	printf("\n");
+	for (uint32_t i = 0; i < size; ) {
+		uint32_t want = size - i < sizeof(actual) ? size - i
+							  : sizeof(actual);
+		int r;
+
+		if (serial_wait_data(NULL, false))
+			return 1;
+		r = serial_read(actual, want);
+		if (r <= 0) {
+			eprintf("Serial read failure %u\n", __LINE__);
+			return 1;
+		}
+		for (int j = 0; j < r && !done; ++j) {
+			if (expect[i + j] == actual[j])
+				continue;
+			if (*diffs == 0)
+				*first_diff = i + j;
+			done = ++*diffs == max_diffs;
+		}
+		i += r;
+		print_progress(i, size);
+
+		/* Old bridges can't be stopped, keep reading without comparing */
+		if (done && i < size && g_bridge.caps & CAP_STREAM_ABORT) {
+			if (serial_send(&abort_cmd, 1) <= 0
+			    || serial_flush()) {
+				perror("Serial write failure");
+				return 1;
+			}
+			serial_drain();
+			break;
+		}
+	}
 	return 0;
 }
+
+static void diff_map_add(struct diff_map *map, uint32_t start, uint32_t size,
+			 bool erase)
+{
+	if (map->count == MAX_DIFF_RANGES) {
+		uint32_t last = map->count - 1;
+
+		map->ranges[last].size = start + size - map->ranges[last].start;
+		map->ranges[last].erase = map->ranges[last].erase || erase;
+	} else {
+		map->ranges[map->count].start = start;
+		map->ranges[map->count].size = size;
+		map->ranges[map->count].erase = erase;
+		++map->count;
+	}
+	map->erase = map->erase || erase;
+}
+
+/*
+ * The expected content goes to the bridge in frames and with credits like the
+ * extents, the bridge compares it with the chip as it reads it and only
+ * answers with the ranges that differ
+ */
+static int serial_diff_range(const uint8_t *expect, uint32_t offset,
+			     uint32_t size, struct diff_map *map)
+{
+	uint8_t cmd = 0x4c;
+	uint8_t inflight_sz[MAX_CREDITS];
+	uint8_t credits = 0, head = 0, count = 0;
+	uint32_t start = 0, done = 0;
+	bool last_sent = false, failed = false;
+	struct timeval timeout = {
+		.tv_sec = 5,
+	};
+
+	if (!(g_bridge.caps & CAP_DIFF))
+		return -1;
+	memset(map, 0, sizeof(*map));
+	if (serial_send(&cmd, 1) <= 0) {
+		perror("Serial write failure");
+		return 1;
+	}
+	if (serial_read_reply(&credits, 1, &timeout))
+		return 1;
+	if (credits == 0) {
+		eprintf("Serial read failure %u\n", __LINE__);
+		return 1;
+	}
+	if (credits > MAX_CREDITS)
+		credits = MAX_CREDITS;
+
+	for (;;) {
+		uint8_t tag, reply[7];
+
+		while (credits && !last_sent) {
+			uint32_t n = size - start < g_bridge.extent_max_sz
+				? size - start : g_bridge.extent_max_sz;
+
+			if (send_extent(expect, offset, start, n))
+				return 1;
+			inflight_sz[(head + count) % MAX_CREDITS] = n;
+			++count;
+			--credits;
+			start += n;
+			last_sent = n == 0;
+		}
+
+		if (serial_read_reply(&tag, 1, &timeout))
+			return 1;
+		if (tag == DIFF_RANGE) {
+			if (serial_read_reply(reply, 7, &timeout))
+				return 1;
+			diff_map_add(map, get_u24(reply), get_u24(&reply[3]),
+				     reply[6]);
+			continue;
+		}
+		if (tag == READ_FAILED) {
+			/* The frames in flight are ignored, end the list */
+			if (serial_read_reply(reply, 3, &timeout))
+				return 1;
+			fflush(stdout);
+			eprintf("\nArduino failed to read address 0x%05x\n",
+				get_u24(reply));
+			if (!last_sent && send_extent(expect, offset, start, 0))
+				return 1;
+			last_sent = failed = true;
+			continue;
+		}
+		if (failed ? tag != 0 : tag != inflight_sz[head]) {
+			eprintf("Serial read failure %u %02x\n", __LINE__, tag);
+			return 1;
+		}
+		if (tag == 0) {
+			if (serial_read_reply(reply, 3, &timeout))
+				return 1;
+			map->diffs = get_u24(reply);
+			return failed;
+		}
+		done += tag;
+		head = (head + 1) % MAX_CREDITS;
+		--count;
+		++credits;
+		print_progress(done, size);
+	}
+}
+
+static int serial_send_all(const uint8_t *data, uint32_t size)
+{
+	for (uint32_t sent = 0; sent < size; ) {
+		ssize_t r = serial_send(&data[sent], size - sent);
+
+		if (r <= 0) {
+			perror("Serial write failure");
+			return 1;
+		}
+		sent += r;
+	}
+	return 0;
+}
+
+/* Starts a loopback test, the payload follows for echo and sink */
+static int serial_loopback(uint8_t mode, uint16_t size)
+{
+	uint8_t cmd[4] = {0x48, mode, size >> 8, size & 0xff};
+
+	return serial_send_all(cmd, sizeof(cmd));
+}
+
+/* micros() of the bridge at the start and at the end of the payload */
+static int serial_loopback_span(uint32_t *span_us)
+{
+	struct timeval timeout = {
+		.tv_sec = 5,
+	};
+	uint8_t reply[8];
+
+	if (serial_read_reply(reply, sizeof(reply), &timeout))
+		return 1;
+	*span_us = get_u32(&reply[4]) - get_u32(reply);
+	return 0;
+}
+
+static double kbps(uint64_t bytes, uint64_t ns)
+{
+	return ns ? bytes * 1e6 / ns : 0;
+}
+
+/*
+ * Round trips of each payload size, what a stream sending chunks of that
+ * size and waiting for each of them to be acknowledged could get at most
+ */
+static int serial_test_latency(void)
+{
+	struct timeval timeout = {
+		.tv_sec = 5,
+	};
+	uint32_t rtt[LOOPBACK_ROUNDS];
+	uint8_t payload[256], echo[256];
+
+	printf("Round trips (%u of each size):\n", LOOPBACK_ROUNDS);
+	for (size_t s = 0; s < sizeof(LOOPBACK_SIZES) / sizeof(LOOPBACK_SIZES[0]);
+	     ++s) {
+		uint32_t size = LOOPBACK_SIZES[s], span_us = 0;
+
+		for (uint32_t i = 0; i < LOOPBACK_ROUNDS; ++i) {
+			struct timespec start;
+
+			for (uint32_t j = 0; j < size; ++j)
+				payload[j] = i + j * 7;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			if (serial_loopback(LOOPBACK_ECHO, size)
+			    || serial_send_all(payload, size)
+			    || serial_read_reply(echo, size, &timeout))
+				return 1;
+			rtt[i] = elapsed_ns(&start);
+			if (memcmp(echo, payload, size)) {
+				eprintf("The bridge echoed corrupted data\n");
+				return 1;
+			}
+			if (serial_loopback_span(&span_us))
+				return 1;
+		}
+		qsort(rtt, LOOPBACK_ROUNDS, sizeof(rtt[0]), cmp_u32);
+		printf("  %3u bytes: p50 %.1fus p99 %.1fus max %.1fus, bridge "
+		       "received it in %uus, %.1f KB/s with one in flight\n",
+		       size, rtt[LOOPBACK_ROUNDS / 2] / 1000.,
+		       rtt[LOOPBACK_ROUNDS * 99 / 100] / 1000.,
+		       rtt[LOOPBACK_ROUNDS - 1] / 1000., span_us,
+		       kbps(size, rtt[LOOPBACK_ROUNDS / 2]));
+	}
+	return 0;
+}
+
+/* The bridge clock times the upload, the host clock the download */
+static int serial_test_bandwidth(void)
+{
+	uint8_t data[LOOPBACK_BULK_SZ];
+	struct timespec start, first;
+	uint64_t host_ns, first_ns = 0;
+	uint32_t span_us, received = 0, first_sz = 0;
+
+	for (uint32_t i = 0; i < LOOPBACK_BULK_SZ; ++i)
+		data[i] = i * 7;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (serial_loopback(LOOPBACK_SINK, LOOPBACK_BULK_SZ)
+	    || serial_send_all(data, LOOPBACK_BULK_SZ)
+	    || serial_loopback_span(&span_us))
+		return 1;
+	host_ns = elapsed_ns(&start);
+	printf("Host to bridge: %.1f KB/s, %.1f KB/s end to end\n",
+	       kbps(LOOPBACK_BULK_SZ - 1, (uint64_t) span_us * 1000),
+	       kbps(LOOPBACK_BULK_SZ, host_ns));
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (serial_loopback(LOOPBACK_SOURCE, LOOPBACK_BULK_SZ))
+		return 1;
+	while (received < LOOPBACK_BULK_SZ) {
+		int r;
+
+		if (serial_wait_data(NULL, false))
+			return 1;
+		r = serial_read(&data[received], LOOPBACK_BULK_SZ - received);
+		if (r <= 0) {
+			eprintf("Serial read failure %u\n", __LINE__);
+			return 1;
+		}
+		/* Only the bytes after the first read are timed */
+		if (received == 0) {
+			clock_gettime(CLOCK_MONOTONIC, &first);
+			first_sz = r;
+		}
+		received += r;
+	}
+	first_ns = elapsed_ns(&first);
+	host_ns = elapsed_ns(&start);
+	if (serial_loopback_span(&span_us))
+		return 1;
+	for (uint32_t i = 0; i < LOOPBACK_BULK_SZ; ++i) {
+		if (data[i] != (uint8_t) i) {
+			eprintf("The bridge sent corrupted data at %u\n", i);
+			return 1;
+		}
+	}
+	printf("Bridge to host: %.1f KB/s, %.1f KB/s end to end, the bridge "
+	       "sent it at %.1f KB/s\n",
+	       kbps(LOOPBACK_BULK_SZ - first_sz, first_ns),
+	       kbps(LOOPBACK_BULK_SZ, host_ns),
+	       kbps(LOOPBACK_BULK_SZ, (uint64_t) span_us * 1000));
+	return 0;
+}
+
+int serial_link_test(void)
+{
+	if (!(g_bridge.caps & CAP_LOOPBACK)) {
+		eprintf("The bridge can't test the link, upload the latest "
+			"sketch to it\n");
+		return 1;
+	}
+	if (g_bridge.baud_rate == 0)
+		printf("Testing the native USB link\n");
+	else
+		printf("Testing the link at %u bauds, %.1f KB/s at most\n",
+		       g_bridge.baud_rate, g_bridge.baud_rate / 10 / 1000.);
+	return serial_test_latency() || serial_test_bandwidth();
+}
+
+const struct transport serial_transport = {
+	.name = "Arduino bridge",
+	.init = serial_init,
+	.io = {
+		.outb = serial_outb,
+		.inb = serial_inb,
+		.inb_post = serial_inb_post,
+		.inb_fetch = serial_inb_fetch,
+		.pentads = serial_pentads,
+	},
+	.read_range = serial_read_byte_stream,
+	.write_range = serial_write_range,
+	.verify_range = serial_verify_range,
+	.diff_range = serial_diff_range,
+	.checksum_range = serial_checksum_range,
+	.erase = serial_erase,
+	.calibrate = serial_calibrate,
+	.set_spin = serial_set_spin,
+	.set_fast = serial_set_fast,
+	.flush = serial_flush,
+	.close = serial_close,
+};
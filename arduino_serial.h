@@ -2,9 +2,26 @@
 
 #include <stdint.h>
 
+#include "config.h"
+
 int serial_init(void);
 
 void serial_outb(uint8_t data);
 uint8_t serial_inb(void);
+void serial_inb_post(void);
+uint8_t serial_inb_fetch(void);
+int serial_pentads(const uint8_t *data, uint8_t count);
 int serial_read_byte_stream(uint8_t *bios_buffer, uint32_t max);
-int serial_write_byte_stream(uint8_t *data, uint32_t data_sz);
+int serial_write_byte_stream(const uint8_t *data, uint32_t data_sz,
+			     uint32_t *failed_at);
+int serial_write_extents(const uint8_t *data, uint32_t offset,
+			 uint32_t data_sz, uint32_t *failed_at);
+int serial_calibrate(struct ack_stats *stats);
+int serial_set_spin(uint32_t spin_us);
+int serial_erase(uint32_t *elapsed_ms);
+/* Modules of the bridge selected with dev@n,... */
+unsigned int serial_module_count(void);
+/* Runs op on each selected module alone, op itself if there is only one */
+int serial_for_each_module(int (*op)(void));
+/* Measures the latency and bandwidth of the link with the bridge */
+int serial_link_test(void);
@@ -0,0 +1,241 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../config.h"
+#include "../handshake.h"
+#include "../transport.h"
+#include "../viper_gc.h"
+
+/*
+ * Throughput of the transports for each bulk operation, on images that
+ * exercise their hot loops differently: blank (nothing to program), dense
+ * (random bytes, no 0xff to skip and no gap between extents) and a typical
+ * image with its code at the start of the chip and mostly 0xff after that.
+ *
+ * The simulator always runs, the serial variants run against the device
+ * given with -s (bridge_emu with make bench) by disabling some of the
+ * accelerated functions of the bridge. Results are printed as one JSON
+ * object per line, the pentads are the ones the protocol needs to move the
+ * data, without the handshake retries.
+ */
+
+_Thread_local struct config g_cfg = {
+	.port = 0x378,
+	.serial = -1,
+	.safe_mode = true,
+	.max_baud = 4000000,
+	.timeout = {
+		.tv_sec = 1,
+	},
+};
+_Thread_local struct ack_record g_ack_record;
+
+void eprintf(const char *format, ...)
+{
+	va_list ap;
+
+	va_start(ap, format);
+	vfprintf(stderr, format, ap);
+	va_end(ap);
+}
+
+struct variant {
+	const char *name;
+	const struct transport *transport;
+	uint16_t disabled_caps;
+	bool fast;
+};
+
+static const char *const IMAGES[] = {"blank", "dense", "typical"};
+
+static FILE *g_out;
+static uint32_t g_size = 0x8000;
+
+static void make_image(const char *kind, uint8_t *image, uint32_t size)
+{
+	uint32_t x = 0x12345678;
+
+	memset(image, 0xff, size);
+	if (strcmp(kind, "blank") == 0)
+		return;
+	for (uint32_t i = 0; i < size; ++i) {
+		/* xorshift32, the same data on every run */
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		if (strcmp(kind, "dense") == 0)
+			image[i] = x;
+		else if (i < size / 4 || (x & 0x1f) == 0)
+			image[i] = x;
+	}
+}
+
+static double seconds_since(const struct timespec *start)
+{
+	return elapsed_ns(start) / 1e9;
+}
+
+static void report(const struct variant *v, const char *image, const char *op,
+		   uint32_t bytes, uint64_t pentads, double seconds, int r)
+{
+	fprintf(g_out, "{\"transport\": \"%s\", \"variant\": \"%s\", "
+		"\"image\": \"%s\", \"op\": \"%s\", \"bytes\": %u, "
+		"\"seconds\": %.6f, \"bytes_per_s\": %.0f, ", v->transport->name,
+		v->name, image, op, bytes, seconds, seconds ? bytes / seconds
+							    : 0);
+	if (pentads)
+		fprintf(g_out, "\"ns_per_pentad\": %.1f, ",
+			seconds * 1e9 / pentads);
+	fprintf(g_out, "\"ok\": %s}\n", r ? "false" : "true");
+	fflush(g_out);
+}
+
+static int init_chip(void)
+{
+	const struct port_io *io = &g_cfg.transport->io;
+
+	outp(io, CMD_RESET);
+	return outp_seq(io, CMD_CHIP_INIT, sizeof(CMD_CHIP_INIT));
+}
+
+/* Like the loader does, but without timing files */
+static void setup_handshake(void)
+{
+	struct ack_stats stats;
+
+	if (calibrate_handshake(&stats) == 0) {
+		if (g_cfg.transport->set_spin)
+			g_cfg.transport->set_spin(stats.spin_us);
+		else
+			g_cfg.spin_us = stats.spin_us;
+	}
+	init_chip();
+}
+
+static void bench_image(const struct variant *v, const char *kind)
+{
+	const struct transport *t = v->transport;
+	const struct port_io *io = &t->io;
+	uint8_t image[BIOS_SIZE], data[BIOS_SIZE];
+	uint32_t programmed = 0, failed_at, first_diff, diffs, elapsed_ms;
+	struct timespec start;
+	int r;
+
+	make_image(kind, image, g_size);
+	for (uint32_t i = 0; i < g_size; ++i)
+		programmed += image[i] != 0xff;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	r = t->erase(&elapsed_ms);
+	report(v, kind, "erase", 0, 0, seconds_since(&start), r);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (v->fast && t->set_fast(true) == 0) {
+		r = t->write_range(image, 0, g_size, &failed_at);
+		t->set_fast(false);
+	} else {
+		r = t->write_range(image, 0, g_size, &failed_at);
+	}
+	outp(io, CMD_RESET);
+	report(v, kind, "write", g_size, (uint64_t) programmed * 9,
+	       seconds_since(&start), r);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	r = init_read_mode(io) || t->read_range(data, g_size);
+	outp(io, CMD_RESET);
+	report(v, kind, "read", g_size, (uint64_t) g_size * 9 + 5,
+	       seconds_since(&start), r);
+
+	/* Every byte is compared, a difference doesn't stop the stream */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	r = init_read_mode(io)
+	 || t->verify_range(image, g_size, 0, &first_diff, &diffs);
+	outp(io, CMD_RESET);
+	report(v, kind, "compare", g_size, (uint64_t) g_size * 9 + 5,
+	       seconds_since(&start), r || diffs);
+}
+
+static int bench_variant(const struct variant *v)
+{
+	g_cfg.transport = v->transport;
+	g_cfg.disabled_caps = v->disabled_caps;
+	g_cfg.spin_us = 0;
+	if (v->transport->init())
+		return 1;
+	if (init_chip()) {
+		eprintf("Viper GC not found.\n");
+		return 1;
+	}
+	setup_handshake();
+	for (size_t i = 0; i < sizeof(IMAGES) / sizeof(IMAGES[0]); ++i)
+		bench_image(v, IMAGES[i]);
+	if (v->transport->close)
+		v->transport->close();
+	return 0;
+}
+
+static void usage_exit(const char *p)
+{
+	printf("Usage: %s [-s dev] [-l ack_latency_ns] [-n size]\n", p);
+	printf("\t-s: Also measure the serial transport through the bridge connected to dev\n");
+	printf("\t-l: ACK latency of the simulated chip (default is 2000)\n");
+	printf("\t-n: Bytes to write, read and compare (default is 0x8000)\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	static const struct variant VARIANTS[] = {
+		{"raw", &sim_transport, 0, false},
+		{"raw_fast", &sim_transport, 0, true},
+		/* What the original sketch offers: 0x80 and 0xc0 60 bytes streams */
+		{"stream", &serial_transport, 0xffff, false},
+		{"extents", &serial_transport, 0, false},
+		{"extents_fast", &serial_transport, 0, true},
+	};
+	unsigned long latency_ns = 2000;
+	int opt, r = EXIT_SUCCESS;
+
+	while ((opt = getopt(argc, argv, "s:l:n:")) != -1) {
+		switch (opt) {
+		case 's':
+			strncpy(g_cfg.serial_dev, optarg,
+				sizeof(g_cfg.serial_dev) - 1);
+			break;
+		case 'l':
+			latency_ns = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			g_size = strtoul(optarg, NULL, 0);
+			if (g_size == 0 || g_size > BIOS_SIZE)
+				usage_exit(argv[0]);
+			break;
+		default:
+			usage_exit(argv[0]);
+		}
+	}
+	snprintf(g_cfg.sim_spec, sizeof(g_cfg.sim_spec),
+		 "/tmp/viper_bench_chip.bin,latency=%lu", latency_ns);
+
+	/* The output of the transports would get in the way of the results */
+	fflush(stdout);
+	g_out = fdopen(dup(STDOUT_FILENO), "w");
+	if (!g_out || !freopen("/dev/null", "w", stdout)) {
+		perror("Unable to redirect the output of the transports");
+		return EXIT_FAILURE;
+	}
+	for (size_t i = 0; i < sizeof(VARIANTS) / sizeof(VARIANTS[0]); ++i) {
+		if (VARIANTS[i].transport == &serial_transport
+		    && !g_cfg.serial_dev[0])
+			continue;
+		if (bench_variant(&VARIANTS[i])) {
+			eprintf("Variant %s failed\n", VARIANTS[i].name);
+			r = EXIT_FAILURE;
+		}
+	}
+	return r;
+}
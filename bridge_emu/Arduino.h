@@ -0,0 +1,141 @@
+#pragma once
+
+/*
+ * Just enough of the Arduino API to run viper_arduino_bridge.ino on a POSIX
+ * host: the port registers drive the chip model and Serial is the PTY. Built
+ * with MODULES, the ports of the Mega drive a chip each.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "../viper_sim.h"
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define B11111100 0xfc
+#define _BV(bit) (1u << (bit))
+#define BRIDGE_EMU 1
+
+#ifndef MODULES
+#define MODULES 1
+#endif
+
+/* The chip of module 0 is also the one wired like on the Nano */
+extern struct viper_sim g_chips[MODULES];
+
+unsigned long micros();
+unsigned long millis();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+int digitalRead(uint8_t pin);
+
+static inline void pinMode(uint8_t, uint8_t)
+{
+}
+
+/* D2-D7 are the data pins of the parallel port */
+struct emu_portd {
+	uint8_t value = 0;
+
+	emu_portd &operator=(uint8_t v)
+	{
+		value = v;
+		viper_sim_outb(&g_chips[0], v >> 2);
+		return *this;
+	}
+	operator uint8_t() const
+	{
+		return value;
+	}
+};
+
+/* D8 and D9 are pins 13 and 15 */
+struct emu_pinb {
+	operator uint8_t() const
+	{
+		uint8_t status = viper_sim_status(&g_chips[0]);
+
+		return (status & 0x10 ? 1 : 0) | (status & 0x08 ? 2 : 0);
+	}
+};
+
+struct emu_reg {
+	uint8_t value = 0;
+
+	emu_reg &operator=(uint8_t v)
+	{
+		value = v;
+		return *this;
+	}
+	operator uint8_t() const
+	{
+		return value;
+	}
+};
+
+extern emu_portd PORTD;
+extern emu_pinb PINB;
+extern emu_reg DDRD;
+
+#if MODULES > 1
+/* Port of module n of the Mega, data on bits 0 to 5 */
+struct emu_module_port {
+	uint8_t module;
+	uint8_t value;
+
+	emu_module_port &operator=(uint8_t v)
+	{
+		value = v;
+		viper_sim_outb(&g_chips[module], v & 0x3f);
+		return *this;
+	}
+	operator uint8_t() const
+	{
+		return value;
+	}
+};
+
+/* Pins 13 and 15 are bits 6 and 7 */
+struct emu_module_pin {
+	uint8_t module;
+
+	operator uint8_t() const
+	{
+		uint8_t status = viper_sim_status(&g_chips[module]);
+
+		return (status & 0x10 ? 0x40 : 0) | (status & 0x08 ? 0x80 : 0);
+	}
+};
+
+extern emu_module_port PORTA, PORTC, PORTL, PORTK;
+extern emu_module_pin PINA, PINC, PINL, PINK;
+extern emu_reg DDRA, DDRC, DDRL, DDRK;
+#endif
+
+class emu_serial {
+public:
+	void begin(unsigned long baud);
+	void setTimeout(unsigned long ms)
+	{
+		timeout = ms;
+	}
+	int available();
+	int read();
+	size_t readBytes(uint8_t *buf, size_t len);
+	size_t write(uint8_t b)
+	{
+		return write(&b, 1);
+	}
+	size_t write(const uint8_t *buf, size_t len);
+	void flush();
+
+private:
+	unsigned long timeout = 1000;
+};
+
+extern emu_serial Serial;
@@ -0,0 +1,491 @@
+#include <atomic>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "Arduino.h"
+#include "../serial_speed.h"
+
+/*
+ * Runs the bridge sketch against the chip model and exposes its serial port
+ * as a PTY, so that the loader and arduino_serial.c can be exercised and
+ * benchmarked end to end without any hardware:
+ *
+ *   ./bridge_emu -L /tmp/viper_tty &
+ *   ./viper_loader -s /tmp/viper_tty -w image.vgc
+ *
+ * Bytes are paced at the emulated baud rate both ways. Received ones get
+ * their arrival time on the wire and go through a 64 bytes buffer like the
+ * one of the Nano when the sketch polls it, overflows are reported on
+ * stderr. Sent ones go through a 64 bytes buffer as well, Serial.write()
+ * blocks while it is full. Bytes only get through when the rate the loader set
+ * on the PTY is the one of the sketch, like a UART they are garbage otherwise.
+ * Built with NATIVE_USB=1 and a larger RX_BUFFER_SIZE, it stands for a board
+ * with native USB instead: bytes move at 1 MB/s whatever the baud rate and
+ * the host waits rather than overflowing the buffer.
+ * Built with MODULES=4, it is a Mega with a chip on each of its 4 ports.
+ */
+
+#ifndef RX_BUFFER_SIZE
+#define RX_BUFFER_SIZE 64
+#endif
+#define TX_BUFFER_SIZE 64
+/* Received by the PTY but not yet on the wire, holds a whole frame window */
+#define WIRE_SZ 4096
+
+struct viper_sim g_chips[MODULES];
+emu_portd PORTD;
+emu_pinb PINB;
+emu_reg DDRD;
+#if MODULES > 1
+emu_module_port PORTA = {0, 0}, PORTC = {1, 0}, PORTL = {2, 0}, PORTK = {3, 0};
+emu_module_pin PINA = {0}, PINC = {1}, PINL = {2}, PINK = {3};
+emu_reg DDRA, DDRC, DDRL, DDRK;
+#endif
+emu_serial Serial;
+
+static int g_master = -1;
+static uint64_t g_start_ns;
+static pthread_mutex_t g_rx_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint8_t g_rx[RX_BUFFER_SIZE];
+static unsigned int g_rx_head, g_rx_count;
+static uint8_t g_wire[WIRE_SZ];
+static uint64_t g_wire_at[WIRE_SZ]; /* When each byte is fully received */
+static unsigned int g_wire_head, g_wire_count;
+static unsigned long g_dropped;
+static uint64_t g_tx_done_ns; /* When the TX buffer is empty */
+#if NATIVE_USB
+static uint64_t g_byte_ns = 1000;
+#else
+static uint64_t g_byte_ns = 10000; /* 10 bits at 1 Mbauds */
+#endif
+/* -b, the rate 1 Mbauds is paced at, other rates follow */
+static unsigned long g_baud_scale = 1000000;
+static unsigned long g_max_baud; /* -M, faster rates garble everything */
+static volatile bool g_garble;
+/* The rates of the sketch and of the PTY, as of the last bytes received */
+static std::atomic<unsigned long> g_serial_baud(BAUD_RATE);
+static std::atomic<uint32_t> g_host_baud(BAUD_RATE);
+static const char *g_dump;
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Time the sketch spent running or sleeping on purpose, unlike the wall clock
+ * it stands still while the host runs other threads. The RX buffer fills at
+ * that pace: a board is never preempted, only its own work delays polling.
+ */
+static clockid_t g_sketch_clock;
+static std::atomic<uint64_t> g_slept_ns;
+
+static uint64_t sketch_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(g_sketch_clock, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec + g_slept_ns;
+}
+
+static void sleep_ns(uint64_t ns)
+{
+	struct timespec d = {
+		(time_t) (ns / 1000000000),
+		(long) (ns % 1000000000),
+	};
+	uint64_t start = now_ns();
+
+	nanosleep(&d, NULL);
+	g_slept_ns += now_ns() - start;
+}
+
+unsigned long micros()
+{
+	return (now_ns() - g_start_ns) / 1000;
+}
+
+unsigned long millis()
+{
+	return (now_ns() - g_start_ns) / 1000000;
+}
+
+void delay(unsigned long ms)
+{
+	sleep_ns(ms * 1000000ull);
+}
+
+void delayMicroseconds(unsigned int us)
+{
+	uint64_t end = now_ns() + us * 1000ull;
+
+	while (now_ns() < end)
+		;
+}
+
+int digitalRead(uint8_t pin)
+{
+	uint8_t status = viper_sim_status(&g_chips[0]);
+
+	if (pin == 8)
+		return !!(status & 0x10);
+	if (pin == 9)
+		return !!(status & 0x08);
+	return LOW;
+}
+
+void emu_serial::begin(unsigned long baud)
+{
+#if NATIVE_USB
+	(void) baud;
+	fprintf(stderr, "bridge_emu: native USB\n");
+#else
+	g_garble = g_max_baud && baud > g_max_baud;
+	g_serial_baud = baud;
+	g_byte_ns = 10000000000ull / g_baud_scale * 1000000 / baud;
+	fprintf(stderr, "bridge_emu: %lu bauds\n", baud);
+#endif
+}
+
+/*
+ * Moves the bytes received by now into the buffer of the sketch. Nothing
+ * drains it in between, so dropping what doesn't fit when the sketch polls
+ * loses the same bytes a UART would have. Called with g_rx_lock held.
+ */
+static void rx_arrive()
+{
+	uint64_t now = sketch_ns();
+
+	while (g_wire_count && g_wire_at[g_wire_head] <= now) {
+		if (g_rx_count < sizeof(g_rx)) {
+			g_rx[(g_rx_head + g_rx_count) % sizeof(g_rx)] =
+				g_wire[g_wire_head];
+			++g_rx_count;
+		} else {
+#if NATIVE_USB
+			break; /* The host waits for the endpoint */
+#else
+			fprintf(stderr, "bridge_emu: RX overflow, %lu bytes "
+				"dropped\n", ++g_dropped);
+#endif
+		}
+		g_wire_head = (g_wire_head + 1) % WIRE_SZ;
+		--g_wire_count;
+	}
+}
+
+int emu_serial::available()
+{
+	unsigned int count;
+
+	pthread_mutex_lock(&g_rx_lock);
+	rx_arrive();
+	count = g_rx_count;
+	pthread_mutex_unlock(&g_rx_lock);
+	if (!count)
+		sched_yield();
+	return count;
+}
+
+int emu_serial::read()
+{
+	int b = -1;
+
+	pthread_mutex_lock(&g_rx_lock);
+	rx_arrive();
+	if (g_rx_count) {
+		b = g_rx[g_rx_head];
+		g_rx_head = (g_rx_head + 1) % sizeof(g_rx);
+		--g_rx_count;
+	}
+	pthread_mutex_unlock(&g_rx_lock);
+	if (b == -1)
+		sched_yield();
+	return b;
+}
+
+size_t emu_serial::readBytes(uint8_t *buf, size_t len)
+{
+	unsigned long start = millis();
+	size_t n = 0;
+
+	while (n < len && millis() - start < timeout) {
+		int b = read();
+
+		if (b == -1)
+			continue;
+		buf[n++] = b;
+		start = millis();
+	}
+	return n;
+}
+
+/*
+ * Sleeps are late by tens of microseconds, bytes keep arriving meanwhile and
+ * would overflow the RX buffer: only the far part of the wait is slept
+ */
+static void wait_until(uint64_t deadline)
+{
+	static const uint64_t SPIN_NS = 200000;
+	uint64_t now = now_ns();
+
+	if (deadline > now + SPIN_NS)
+		sleep_ns(deadline - now - SPIN_NS);
+	while (now_ns() < deadline)
+		sched_yield();
+}
+
+/* Waits for room in the TX buffer, the host gets the bytes right away */
+static void tx_pace(size_t len)
+{
+	uint64_t now = now_ns();
+
+	if (g_tx_done_ns < now)
+		g_tx_done_ns = now;
+	g_tx_done_ns += len * g_byte_ns;
+	wait_until(g_tx_done_ns - TX_BUFFER_SIZE * g_byte_ns);
+}
+
+void emu_serial::flush()
+{
+	wait_until(g_tx_done_ns);
+}
+
+size_t emu_serial::write(const uint8_t *buf, size_t len)
+{
+	size_t sent = 0;
+
+	tx_pace(len);
+#if !NATIVE_USB
+	/* The host can't make anything out of them */
+	if (g_host_baud != g_serial_baud)
+		return len;
+#endif
+	while (sent < len) {
+		ssize_t r = ::write(g_master, buf + sent, len - sent);
+
+		if (r > 0)
+			sent += r;
+		else if (errno != EAGAIN && errno != EINTR)
+			break;
+	}
+	return sent;
+}
+
+/*
+ * Timestamps every byte with the end of its transmission, one after the other
+ * from when the PTY got them, in the time of the sketch. The sketch picks
+ * them up in rx_arrive().
+ */
+static void *rx_thread(void *)
+{
+	uint64_t next = 0;
+
+	for (;;) {
+		uint8_t buf[256];
+		unsigned int room;
+		ssize_t r;
+
+		pthread_mutex_lock(&g_rx_lock);
+		room = WIRE_SZ - g_wire_count;
+		pthread_mutex_unlock(&g_rx_lock);
+		/* Like a full kernel buffer, the host waits */
+		if (room < sizeof(buf)) {
+			usleep(100);
+			continue;
+		}
+
+		r = ::read(g_master, buf, sizeof(buf));
+		/* Nobody has the PTY open */
+		if (r <= 0) {
+			usleep(1000);
+			continue;
+		}
+#if !NATIVE_USB
+		uint32_t baud;
+
+		if (serial_get_speed(g_master, &baud) == 0)
+			g_host_baud = baud;
+		if (g_host_baud != g_serial_baud) {
+			fprintf(stderr, "bridge_emu: %zd bytes sent at %u bauds "
+				"lost at %lu bauds\n", r, (unsigned) g_host_baud,
+				(unsigned long) g_serial_baud);
+			continue;
+		}
+#endif
+
+		pthread_mutex_lock(&g_rx_lock);
+		if (next < sketch_ns())
+			next = sketch_ns();
+		for (ssize_t i = 0; i < r; ++i) {
+			unsigned int tail = (g_wire_head + g_wire_count)
+				% WIRE_SZ;
+
+			next += g_byte_ns;
+			g_wire[tail] = g_garble ? buf[i] ^ 0x24 : buf[i];
+			g_wire_at[tail] = next;
+			++g_wire_count;
+		}
+		pthread_mutex_unlock(&g_rx_lock);
+	}
+	return NULL;
+}
+
+/*
+ * Saves the chips with -d when killed, the one of module n into dump.n. The
+ * exit status tells whether received bytes were dropped meanwhile.
+ */
+static void on_signal(int)
+{
+	for (unsigned int m = 0; g_dump && m < MODULES; ++m) {
+		char path[4096];
+		FILE *f;
+
+		if (m == 0)
+			snprintf(path, sizeof(path), "%s", g_dump);
+		else
+			snprintf(path, sizeof(path), "%s.%u", g_dump, m);
+		f = fopen(path, "wb");
+		if (f) {
+			fwrite(g_chips[m].flash, 1, sizeof(g_chips[m].flash), f);
+			fclose(f);
+		}
+	}
+	_exit(g_dropped ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+static int open_pty(const char *link)
+{
+	struct termios tty;
+	int slave;
+
+	g_master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (g_master == -1 || grantpt(g_master) || unlockpt(g_master)) {
+		perror("Unable to create a PTY");
+		return 1;
+	}
+	/* Raw until the loader configures it */
+	slave = open(ptsname(g_master), O_RDWR | O_NOCTTY);
+	if (slave == -1 || tcgetattr(slave, &tty)) {
+		perror("Unable to open the PTY");
+		return 1;
+	}
+	cfmakeraw(&tty);
+	tcsetattr(slave, TCSANOW, &tty);
+	if (link) {
+		unlink(link);
+		if (symlink(ptsname(g_master), link)) {
+			perror("Unable to link the PTY");
+			return 1;
+		}
+	}
+	printf("%s\n", ptsname(g_master));
+	fflush(stdout);
+	return 0;
+}
+
+static void usage_exit(const char *p)
+{
+	fprintf(stderr, "Usage: %s [-L link] [-i image] [-d dump] [-l ack_latency_ns] [-e erase_ms] [-b baud] [-M max_baud] [-f n] [-g n] [-r]\n", p);
+	fprintf(stderr, "\t-L: Symlink to the PTY, its name is printed anyway\n");
+	fprintf(stderr, "\t-i: Load the chip (all of them with MODULES) with image\n");
+	fprintf(stderr, "\t-d: Save the chip into dump when killed, the one of module n into dump.n\n");
+	fprintf(stderr, "\t-l: Time the chip takes to ACK pentads (default is 2000)\n");
+	fprintf(stderr, "\t-e: Time the chip takes to erase (default is 200)\n");
+	fprintf(stderr, "\t-b: Pace received bytes like baud does at 1 Mbauds, faster rates are paced accordingly\n");
+	fprintf(stderr, "\t-M: Garble the bytes received at rates above max_baud\n");
+	fprintf(stderr, "\t-f: The nth write command is lost and stalls the chip (the last module with MODULES)\n");
+	fprintf(stderr, "\t-g: The nth write command is silently ignored (same)\n");
+	fprintf(stderr, "\t-r: The pentads after the read init command set the address\n");
+	exit(EXIT_FAILURE);
+}
+
+/* The sketch itself, on top of the emulated Arduino */
+#include "../viper_arduino_bridge/viper_arduino_bridge.ino"
+
+int main(int argc, char **argv)
+{
+	const char *link = NULL, *image = NULL;
+	uint32_t fail_write = 0, drop_write = 0;
+	struct viper_sim chip;
+	pthread_t thread;
+	int opt;
+
+	viper_sim_init(&chip);
+	while ((opt = getopt(argc, argv, "L:i:d:l:e:b:M:f:g:r")) != -1) {
+		switch (opt) {
+		case 'L':
+			link = optarg;
+			break;
+		case 'i':
+			image = optarg;
+			break;
+		case 'd':
+			g_dump = optarg;
+			break;
+		case 'l':
+			chip.ack_latency_ns = strtoul(optarg, NULL, 0);
+			break;
+		case 'e':
+			chip.erase_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			g_baud_scale = strtoul(optarg, NULL, 0);
+			if (g_baud_scale == 0)
+				usage_exit(argv[0]);
+			g_byte_ns = 10000000000ull / g_baud_scale;
+			break;
+		case 'M':
+			g_max_baud = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			fail_write = strtoul(optarg, NULL, 0);
+			break;
+		case 'g':
+			drop_write = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			chip.seed_read = 1;
+			break;
+		default:
+			usage_exit(argv[0]);
+		}
+	}
+	if (image) {
+		FILE *f = fopen(image, "rb");
+
+		if (!f || fread(chip.flash, 1, sizeof(chip.flash), f) == 0) {
+			fprintf(stderr, "Unable to load '%s'\n", image);
+			return EXIT_FAILURE;
+		}
+		fclose(f);
+	}
+	for (unsigned int m = 0; m < MODULES; ++m)
+		g_chips[m] = chip;
+	/* Faults are injected in a module other than the one being read */
+	g_chips[MODULES - 1].fail_write = fail_write;
+	g_chips[MODULES - 1].drop_write = drop_write;
+	if (open_pty(link))
+		return EXIT_FAILURE;
+
+	signal(SIGTERM, on_signal);
+	signal(SIGINT, on_signal);
+	g_start_ns = now_ns();
+	pthread_getcpuclockid(pthread_self(), &g_sketch_clock);
+	pthread_create(&thread, NULL, rx_thread, NULL);
+	setup();
+	for (;;)
+		loop();
+}
@@ -1,32 +1,98 @@
 #pragma once
 
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
-#include <sys/select.h>
+#include <stdio.h>
+#include <sys/time.h>
 
 enum operation {
 	OP_UNSET,
 	OP_READ,
 	OP_WRITE,
 	OP_COMPARE,
+	OP_VERIFY,
+	OP_LINK_TEST,
 };
 
+/* Distribution of the chip ACK latency measured by calibrate_handshake() */
+struct ack_stats {
+	uint32_t p50_ns;
+	uint32_t p99_ns;
+	uint32_t max_ns;
+	uint32_t spin_us; /* Busy wait that long before sleeping */
+};
+
+/*
+ * Where the chip differs from an image. Ranges may include matching bytes
+ * between close differences, once full the last one grows to cover the next.
+ */
+#define MAX_DIFF_RANGES 256
+struct diff_map {
+	struct {
+		uint32_t start;
+		uint32_t size;
+		bool erase; /* Some bits have to be set back to 1 */
+	} ranges[MAX_DIFF_RANGES];
+	uint32_t count;
+	uint32_t diffs; /* Bytes that differ */
+	bool erase;
+};
+
+/* How far the current operation is, followed by the farm mode */
+struct progress {
+	atomic_uint done;
+	atomic_uint total;
+	atomic_bool finished;
+};
+
+/* -r can be repeated to write the same dump to several files */
+#define MAX_DUMP_FILES 4
+
+struct transport;
+struct image;
+struct dump;
+
 struct config {
 	enum operation operation;
 	bool safe_mode;
+	bool delta; /* Only program what changed when no erase is needed */
+	bool fast; /* Write without ACKs then fix the blocks that failed */
+	bool blank_check; /* Skip the erase on blank chips */
+	bool verify_written; /* Verify the chip once written, same session */
+	bool paced; /* Pentads are paced by spin_us instead of waiting for ACKs */
+	bool low_latency; /* Real-time scheduling, see realtime.h */
+	uint32_t spin_us; /* Time spent polling ACKs before sleeping */
+	uint32_t max_diffs; /* Compare stops after that many, 0 for no limit */
+	uint32_t offset; /* Window of the chip to access, all of it if 0 */
+	uint32_t length;
+	bool resume; /* Continue writing at resume_at without erasing */
+	uint32_t resume_at;
+	const struct transport *transport;
 	uint16_t port;
 	int serial; /* Serial device fd */
-	fd_set serial_s;
+	uint32_t max_baud; /* Fastest rate to negotiate with the bridge */
+	uint16_t disabled_caps; /* Bridge functions not to use, for benchmarks */
 	struct timeval timeout;
 	char file_path[256];
+	char copy_paths[MAX_DUMP_FILES - 1][256]; /* More files to dump to */
+	unsigned int copies;
 	char serial_dev[256];
+	char timing_path[256]; /* Persisted handshake calibrations */
+	char sim_spec[256]; /* Simulated chip instead of a device, see sim_port.c */
+	const struct image *image; /* Loaded from file_path unless reading */
+	struct dump *dump; /* Gets the bytes read by read_bios() */
+	struct progress *progress; /* Set for the workers of the farm mode */
+	FILE *err; /* Client of the job in daemon mode */
 };
 
-extern struct config g_cfg;
+/* Each worker of the farm mode has its own */
+extern _Thread_local struct config g_cfg;
 
 static inline bool use_serial()
 {
 	return g_cfg.serial != -1;
 }
 
-#define eprintf(...) fprintf(stderr, __VA_ARGS__)
+/* Errors, prefixed by the device in farm mode and sent to daemon clients */
+void eprintf(const char *format, ...) __attribute__((format(printf, 1, 2)));
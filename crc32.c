@@ -0,0 +1,26 @@
+#include "crc32.h"
+
+#include <pthread.h>
+
+static uint32_t crc32_table[256];
+
+static void crc32_init_table(void)
+{
+	for (uint32_t i = 0; i < 256; ++i) {
+		uint32_t c = i;
+
+		for (uint8_t k = 0; k < 8; ++k)
+			c = (c >> 1) ^ (0xedb88320 & -(c & 1));
+		crc32_table[i] = c;
+	}
+}
+
+uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t size)
+{
+	static pthread_once_t table_ready = PTHREAD_ONCE_INIT;
+
+	pthread_once(&table_ready, crc32_init_table);
+	for (size_t i = 0; i < size; ++i)
+		crc = crc32_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	return crc;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* CRC-32 (IEEE 802.3), same as zlib and the Arduino bridge */
+#define CRC32_INIT 0xffffffff
+
+uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t size);
+
+static inline uint32_t crc32_final(uint32_t crc)
+{
+	return ~crc;
+}
+
+static inline uint32_t crc32(const uint8_t *data, size_t size)
+{
+	return crc32_final(crc32_update(CRC32_INIT, data, size));
+}
+
+/* CRC32 of each block_sz bytes of data, the last block may be shorter */
+static inline void crc32_blocks(const uint8_t *data, uint32_t size,
+				uint32_t block_sz, uint32_t *crcs)
+{
+	if (block_sz == 0)
+		block_sz = size;
+	for (uint32_t i = 0; i < size; i += block_sz)
+		crcs[i / block_sz] = crc32(&data[i], size - i < block_sz
+					   ? size - i : block_sz);
+}
@@ -0,0 +1,415 @@
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "daemon.h"
+#include "image.h"
+
+/*
+ * The daemon holds the bridges open between jobs: opening a tty resets the
+ * Arduino which then takes a second to boot, and the chip init and handshake
+ * calibration only have to happen once.
+ *
+ * Jobs are given with the options of the command line, each one sent by the
+ * client as a NUL terminated string and an empty one to end the job. The
+ * daemon replies with the errors of the job followed by a NUL byte and its
+ * exit status.
+ */
+
+#define WORKER_STACK_SZ (16 << 20)
+#define JOB_MAX 4096
+#define JOB_MAX_ARGS 32
+
+struct job {
+	int client;
+	int argc;
+	char *argv[JOB_MAX_ARGS + 1];
+	char buf[JOB_MAX];
+	struct job *next;
+};
+
+struct device {
+	pthread_t thread;
+	const char *name; /* Empty for the parallel port */
+	const struct config *base;
+	const struct daemon_ops *ops;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct job *head, *tail;
+};
+
+/* getopt() isn't reentrant */
+static pthread_mutex_t g_parse_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *g_log;
+
+static const char *display_name(const struct device *d)
+{
+	return d->name[0] ? d->name : "parallel port";
+}
+
+static void finish_job(struct job *job, FILE *out, int status)
+{
+	fputc('\0', out);
+	fputc(status ? EXIT_FAILURE : EXIT_SUCCESS, out);
+	fclose(out);
+	free(job);
+}
+
+static struct job *next_job(struct device *d)
+{
+	struct job *job;
+
+	pthread_mutex_lock(&d->lock);
+	while (!d->head)
+		pthread_cond_wait(&d->cond, &d->lock);
+	job = d->head;
+	d->head = job->next;
+	if (!d->head)
+		d->tail = NULL;
+	pthread_mutex_unlock(&d->lock);
+	return job;
+}
+
+/* Errors go to out, the client of the job that needs the device if any */
+static int open_device(struct device *d, struct config *ready, FILE *out)
+{
+	g_cfg = *d->base;
+	strncpy(g_cfg.serial_dev, d->name, sizeof(g_cfg.serial_dev) - 1);
+	g_cfg.err = out;
+	if (d->ops->open()) {
+		fprintf(g_log, "%s: not ready, retrying with the next job\n",
+			display_name(d));
+		return 1;
+	}
+	fprintf(g_log, "%s: ready\n", display_name(d));
+	*ready = g_cfg;
+	ready->err = NULL;
+	return 0;
+}
+
+static void *worker_main(void *arg)
+{
+	struct device *d = arg;
+	struct config ready;
+	bool opened = open_device(d, &ready, NULL) == 0;
+
+	for (;;) {
+		struct job *job = next_job(d);
+		FILE *out = fdopen(job->client, "w");
+		int r;
+
+		if (!out) {
+			close(job->client);
+			free(job);
+			continue;
+		}
+		setvbuf(out, NULL, _IONBF, 0);
+		if (!opened)
+			opened = open_device(d, &ready, out) == 0;
+		if (!opened) {
+			fprintf(out, "Device %s is not ready\n",
+				display_name(d));
+			finish_job(job, out, 1);
+			continue;
+		}
+
+		g_cfg = ready;
+		g_cfg.err = out;
+		pthread_mutex_lock(&g_parse_lock);
+		r = d->ops->parse(job->argc, job->argv);
+		pthread_mutex_unlock(&g_parse_lock);
+		if (r == 0)
+			r = d->ops->run();
+		/* Unplugged or reset, it has to be opened again */
+		if (r && d->ops->check()) {
+			fprintf(g_log, "%s: lost, reopening with the next job\n",
+				display_name(d));
+			d->ops->close();
+			opened = false;
+		}
+		image_put(g_cfg.image);
+		g_cfg.err = NULL;
+
+		fprintf(g_log, "%s: job %s %s %s\n", display_name(d),
+			job->argv[1], job->argc > 2 ? job->argv[2] : "",
+			r ? "failed" : "done");
+		fflush(g_log);
+		finish_job(job, out, r);
+	}
+	return NULL;
+}
+
+/* Reads the arguments of a job, argv[0] is a placeholder for getopt() */
+static int receive_job(struct job *job)
+{
+	static const struct timeval TIMEOUT = {.tv_sec = 1};
+	size_t len = 0;
+
+	setsockopt(job->client, SOL_SOCKET, SO_RCVTIMEO, &TIMEOUT,
+		   sizeof(TIMEOUT));
+	while (len < 2 || job->buf[len - 1] || job->buf[len - 2]) {
+		ssize_t r;
+
+		if (len == sizeof(job->buf))
+			return 1;
+		r = read(job->client, &job->buf[len], sizeof(job->buf) - len);
+		if (r <= 0)
+			return 1;
+		len += r;
+	}
+
+	job->argv[job->argc++] = "viper_loader";
+	for (char *arg = job->buf; *arg; arg += strlen(arg) + 1) {
+		if (job->argc == JOB_MAX_ARGS)
+			return 1;
+		job->argv[job->argc++] = arg;
+	}
+	job->argv[job->argc] = NULL;
+	return job->argc < 2;
+}
+
+/* Jobs go to the device given with -s, the first one by default */
+static struct device *job_device(const struct job *job, struct device *devices,
+				 unsigned int count)
+{
+	for (int i = 1; i + 1 < job->argc; ++i) {
+		if (strcmp(job->argv[i], "-s"))
+			continue;
+		for (unsigned int j = 0; j < count; ++j) {
+			if (strcmp(devices[j].name, job->argv[i + 1]) == 0)
+				return &devices[j];
+		}
+		return NULL;
+	}
+	return &devices[0];
+}
+
+static void queue_job(struct device *d, struct job *job)
+{
+	pthread_mutex_lock(&d->lock);
+	if (d->tail)
+		d->tail->next = job;
+	else
+		d->head = job;
+	d->tail = job;
+	pthread_cond_signal(&d->cond);
+	pthread_mutex_unlock(&d->lock);
+}
+
+static void reject_job(struct job *job, const char *msg)
+{
+	FILE *out = fdopen(job->client, "w");
+
+	if (!out) {
+		close(job->client);
+		free(job);
+		return;
+	}
+	fputs(msg, out);
+	finish_job(job, out, 1);
+}
+
+/*
+ * Only removes the socket left behind by a daemon that was killed, not a file
+ * or the socket of a daemon that is still running
+ */
+static int remove_stale_socket(const struct sockaddr_un *addr)
+{
+	struct stat st;
+	int s, r, err;
+
+	if (lstat(addr->sun_path, &st)) {
+		if (errno == ENOENT)
+			return 0;
+		perror("Unable to check the socket path");
+		return -1;
+	}
+	if (!S_ISSOCK(st.st_mode)) {
+		eprintf("'%s' exists and isn't a socket\n", addr->sun_path);
+		return -1;
+	}
+	s = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (s == -1) {
+		perror("Unable to create the socket");
+		return -1;
+	}
+	r = connect(s, (const struct sockaddr *) addr, sizeof(*addr));
+	err = errno;
+	close(s);
+	if (r == 0) {
+		eprintf("A daemon is already listening on '%s'\n",
+			addr->sun_path);
+		return -1;
+	} else if (err != ECONNREFUSED) {
+		errno = err;
+		perror("Unable to check the socket");
+		return -1;
+	}
+	if (unlink(addr->sun_path)) {
+		perror("Unable to remove the stale socket");
+		return -1;
+	}
+	return 0;
+}
+
+static int listen_on(const char *socket_path)
+{
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	int s;
+
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+		eprintf("Socket path is too long\n");
+		return -1;
+	}
+	strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+	if (remove_stale_socket(&addr))
+		return -1;
+	s = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (s == -1) {
+		perror("Unable to create the socket");
+		return -1;
+	}
+	if (bind(s, (struct sockaddr *) &addr, sizeof(addr))
+	    || listen(s, 16)) {
+		perror("Unable to listen on the socket");
+		close(s);
+		return -1;
+	}
+	return s;
+}
+
+int daemon_run(const struct config *base, const char *socket_path,
+	       const char *const *devices, unsigned int count,
+	       const struct daemon_ops *ops)
+{
+	static const char *const PARALLEL[] = {""};
+	struct device *devs;
+	pthread_attr_t attr;
+	int s;
+
+	if (count == 0) {
+		devices = PARALLEL;
+		count = 1;
+	}
+	devs = calloc(count, sizeof(*devs));
+	if (!devs)
+		return EXIT_FAILURE;
+	s = listen_on(socket_path);
+	if (s == -1) {
+		free(devs);
+		return EXIT_FAILURE;
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	/* Devices only log when they're ready and when jobs are done */
+	fflush(stdout);
+	g_log = fdopen(dup(STDOUT_FILENO), "w");
+	if (!g_log || !freopen("/dev/null", "w", stdout)) {
+		perror("Unable to redirect the output of the devices");
+		return EXIT_FAILURE;
+	}
+	setvbuf(g_log, NULL, _IOLBF, 0);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, WORKER_STACK_SZ);
+	for (unsigned int i = 0; i < count; ++i) {
+		struct device *d = &devs[i];
+
+		d->name = devices[i];
+		d->base = base;
+		d->ops = ops;
+		pthread_mutex_init(&d->lock, NULL);
+		pthread_cond_init(&d->cond, NULL);
+		if (pthread_create(&d->thread, &attr, worker_main, d)) {
+			eprintf("Unable to start a worker for %s\n",
+				display_name(d));
+			return EXIT_FAILURE;
+		}
+	}
+	pthread_attr_destroy(&attr);
+	fprintf(g_log, "Listening on %s\n", socket_path);
+
+	for (;;) {
+		struct job *job;
+		struct device *d;
+		int client = accept(s, NULL, NULL);
+
+		if (client == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			perror("Unable to accept jobs");
+			return EXIT_FAILURE;
+		}
+		job = calloc(1, sizeof(*job));
+		if (!job) {
+			close(client);
+			continue;
+		}
+		job->client = client;
+		if (receive_job(job)) {
+			reject_job(job, "Invalid job\n");
+			continue;
+		}
+		d = job_device(job, devs, count);
+		if (!d) {
+			reject_job(job, "Unknown device\n");
+			continue;
+		}
+		queue_job(d, job);
+	}
+}
+
+int daemon_submit(const char *socket_path, const char *const *args,
+		  unsigned int count)
+{
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	char reply[256 + 1]; /* Room for the status after a final NUL */
+	ssize_t r;
+	int s;
+
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+		eprintf("Socket path is too long\n");
+		return EXIT_FAILURE;
+	}
+	strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+	s = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (s == -1 || connect(s, (struct sockaddr *) &addr, sizeof(addr))) {
+		perror("Unable to connect to the daemon");
+		if (s != -1)
+			close(s);
+		return EXIT_FAILURE;
+	}
+	for (unsigned int i = 0; i <= count; ++i) {
+		const char *arg = i < count ? args[i] : "";
+
+		if (write(s, arg, strlen(arg) + 1) != (ssize_t) strlen(arg) + 1) {
+			perror("Unable to send the job");
+			close(s);
+			return EXIT_FAILURE;
+		}
+	}
+
+	/* Errors of the job until a NUL byte and the exit status */
+	while ((r = read(s, reply, sizeof(reply) - 1)) > 0) {
+		char *end = memchr(reply, '\0', r);
+
+		fwrite(reply, 1, end ? end - reply : r, stderr);
+		if (!end)
+			continue;
+		if (end + 1 == reply + r && read(s, end + 1, 1) != 1)
+			break;
+		close(s);
+		return end[1];
+	}
+	close(s);
+	eprintf("Lost the connection to the daemon\n");
+	return EXIT_FAILURE;
+}
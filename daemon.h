@@ -0,0 +1,29 @@
+#pragma once
+
+#include "config.h"
+
+struct daemon_ops {
+	/* Gets the device of g_cfg ready for jobs */
+	int (*open)(void);
+	/* Applies the arguments of a job to g_cfg, one job at a time */
+	int (*parse)(int argc, char **argv);
+	int (*run)(void);
+	/* Whether the device still answers, after a failed job */
+	int (*check)(void);
+	/* Releases the device, the next job opens it again */
+	void (*close)(void);
+};
+
+/*
+ * Keeps the devices open, one thread each with a copy of base as
+ * configuration, and runs the jobs received on the Unix socket at
+ * socket_path. There is a single device without name for the parallel port.
+ * Only returns on error.
+ */
+int daemon_run(const struct config *base, const char *socket_path,
+	       const char *const *devices, unsigned int count,
+	       const struct daemon_ops *ops);
+
+/* Sends a job to the daemon, prints its errors and returns its status */
+int daemon_submit(const char *socket_path, const char *const *args,
+		  unsigned int count);
@@ -0,0 +1,93 @@
+#include <errno.h>
+#include <libgen.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "crc32.h"
+#include "dump.h"
+
+int dump_open(struct dump *d, const char *const *paths, unsigned int count)
+{
+	memset(d, 0, sizeof(*d));
+	sha256_init(&d->sha);
+	d->crc = CRC32_INIT;
+	for (unsigned int i = 0; i < count; ++i) {
+		d->files[i] = fopen(paths[i], "wb+");
+		if (!d->files[i]) {
+			eprintf("Couldn't create file '%s', check access "
+				"rights\n", paths[i]);
+			dump_close(d, false);
+			return 1;
+		}
+		d->paths[i] = paths[i];
+		d->count = i + 1;
+	}
+	return 0;
+}
+
+void dump_update(struct dump *d, const uint8_t *data, uint32_t done)
+{
+	const uint8_t *start = &data[d->written];
+	uint32_t size = done - d->written;
+
+	if (done <= d->written)
+		return;
+	sha256_update(&d->sha, start, size);
+	d->crc = crc32_update(d->crc, start, size);
+	for (unsigned int i = 0; i < d->count; ++i) {
+		if (fwrite(start, 1, size, d->files[i]) != size && !d->failed) {
+			eprintf("\nCouldn't write to '%s': %s\n", d->paths[i],
+				strerror(errno));
+			d->failed = true;
+		}
+	}
+	d->written = done;
+}
+
+static int save_digest(const char *path, const char *hex)
+{
+	char sum_path[PATH_MAX];
+	char name[PATH_MAX];
+	FILE *f;
+
+	snprintf(sum_path, sizeof(sum_path), "%s.sha256", path);
+	snprintf(name, sizeof(name), "%s", path);
+	f = fopen(sum_path, "w");
+	if (!f) {
+		eprintf("Couldn't create file '%s'\n", sum_path);
+		return 1;
+	}
+	/* Relative to the directory of the dump, for sha256sum -c */
+	fprintf(f, "%s  %s\n", hex, basename(name));
+	return fclose(f) != 0;
+}
+
+int dump_close(struct dump *d, bool complete)
+{
+	uint8_t digest[SHA256_SIZE];
+	char hex[SHA256_SIZE * 2 + 1];
+	int r = d->failed;
+
+	for (unsigned int i = 0; i < d->count; ++i) {
+		if (fclose(d->files[i]) && !d->failed) {
+			eprintf("Couldn't write to '%s': %s\n", d->paths[i],
+				strerror(errno));
+			r = 1;
+		}
+	}
+	if (!complete || r) {
+		for (unsigned int i = 0; i < d->count; ++i)
+			unlink(d->paths[i]);
+		return 1;
+	}
+
+	sha256_final(&d->sha, digest);
+	for (unsigned int i = 0; i < SHA256_SIZE; ++i)
+		sprintf(&hex[i * 2], "%02x", digest[i]);
+	printf("SHA-256 %s, CRC32 %08x\n", hex, crc32_final(d->crc));
+	for (unsigned int i = 0; i < d->count; ++i)
+		r |= save_digest(d->paths[i], hex);
+	return r;
+}
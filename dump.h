@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "config.h"
+#include "sha256.h"
+
+/*
+ * Output of read_bios(), the transports hand it the bytes as they are read
+ * from the chip so that the files and their digests are complete as soon as
+ * the last byte arrives
+ */
+struct dump {
+	FILE *files[MAX_DUMP_FILES];
+	const char *paths[MAX_DUMP_FILES];
+	unsigned int count;
+	uint32_t written; /* Bytes of the range handed over so far */
+	bool failed; /* A file couldn't be written */
+	struct sha256 sha;
+	uint32_t crc;
+};
+
+/* Creates all the files before the chip is read */
+int dump_open(struct dump *d, const char *const *paths, unsigned int count);
+/* data is the start of the range being read, done how much of it arrived */
+void dump_update(struct dump *d, const uint8_t *data, uint32_t done);
+/*
+ * Closes the files and writes the SHA-256 of a complete dump next to each of
+ * them as <path>.sha256, in the format of sha256sum. Incomplete dumps are
+ * removed.
+ */
+int dump_close(struct dump *d, bool complete);
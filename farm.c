@@ -0,0 +1,123 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "farm.h"
+
+/*
+ * Farm mode drives several bridges from a single process with one worker
+ * thread per device. Everything a transport keeps about its device is thread
+ * local and the configuration of a worker starts as a copy of the command line
+ * one, images are only loaded once and shared read-only.
+ *
+ * The main thread prints the progress of all the devices on a single line, the
+ * messages of the workers are dropped and their errors are prefixed by the
+ * name of their device.
+ */
+
+/* Operations keep whole images of the chip on the stack */
+#define WORKER_STACK_SZ (16 << 20)
+#define REFRESH_US 200000
+
+struct worker {
+	pthread_t thread;
+	const struct config *base;
+	const char *device;
+	int (*run)(void);
+	struct progress progress;
+	int status;
+};
+
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+
+	g_cfg = *w->base;
+	strncpy(g_cfg.serial_dev, w->device, sizeof(g_cfg.serial_dev) - 1);
+	g_cfg.progress = &w->progress;
+	w->status = w->run();
+	atomic_store(&w->progress.finished, true);
+	return NULL;
+}
+
+static unsigned int print_progress_line(FILE *out, struct worker *workers,
+					unsigned int count)
+{
+	unsigned int finished = 0, failed = 0, percent = 0;
+
+	for (unsigned int i = 0; i < count; ++i) {
+		struct progress *p = &workers[i].progress;
+		uint32_t total = atomic_load(&p->total);
+
+		if (atomic_load(&p->finished)) {
+			++finished;
+			failed += workers[i].status != 0;
+		} else if (total) {
+			percent += (uint64_t) atomic_load(&p->done) * 100
+				/ total;
+		}
+	}
+	fprintf(out, "\r%u/%u devices done, %u failed", finished, count,
+		failed);
+	if (finished < count)
+		fprintf(out, ", %02u%% on the others", percent
+			/ (count - finished));
+	fflush(out);
+	return finished;
+}
+
+int farm_run(const struct config *base, const char *const *devices,
+	     unsigned int count, int (*run)(void))
+{
+	struct worker *workers = calloc(count, sizeof(*workers));
+	pthread_attr_t attr;
+	unsigned int started = 0;
+	int r = EXIT_SUCCESS;
+	FILE *out;
+
+	if (!workers)
+		return EXIT_FAILURE;
+	fflush(stdout);
+	out = fdopen(dup(STDOUT_FILENO), "w");
+	if (!out || !freopen("/dev/null", "w", stdout)) {
+		perror("Unable to redirect the output of the workers");
+		free(workers);
+		return EXIT_FAILURE;
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, WORKER_STACK_SZ);
+	for (; started < count; ++started) {
+		struct worker *w = &workers[started];
+
+		w->base = base;
+		w->device = devices[started];
+		w->run = run;
+		if (pthread_create(&w->thread, &attr, worker_main, w)) {
+			eprintf("Unable to start a worker for %s\n",
+				w->device);
+			r = EXIT_FAILURE;
+			break;
+		}
+	}
+	pthread_attr_destroy(&attr);
+
+	while (print_progress_line(out, workers, started) < started)
+		usleep(REFRESH_US);
+	fprintf(out, "\n");
+
+	for (unsigned int i = 0; i < started; ++i) {
+		pthread_join(workers[i].thread, NULL);
+		fprintf(out, "%s: %s\n", workers[i].device,
+			workers[i].status ? "failed" : "done");
+		if (workers[i].status)
+			r = EXIT_FAILURE;
+	}
+	fclose(out);
+	free(workers);
+	return r;
+}
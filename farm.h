@@ -0,0 +1,10 @@
+#pragma once
+
+#include "config.h"
+
+/*
+ * Runs run() once per device, each in its own thread and with a copy of base
+ * as configuration. Returns EXIT_SUCCESS if it succeeded for all of them.
+ */
+int farm_run(const struct config *base, const char *const *devices,
+	     unsigned int count, int (*run)(void));
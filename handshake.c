@@ -0,0 +1,54 @@
+#include <stdlib.h>
+
+#include "config.h"
+#include "handshake.h"
+#include "transport.h"
+#include "viper_gc.h"
+
+int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * Measures how long the chip takes to ACK pentads by reading the first bytes
+ * of its memory, safe_mode_check() then spins for a bit more than the 99th
+ * percentile before sleeping. The Arduino does the measurement on its side.
+ */
+int calibrate_handshake(struct ack_stats *stats)
+{
+	static const uint32_t CALIBRATION_BYTES = 32;
+	static const uint32_t MAX_SPIN_US = 1000;
+	uint32_t samples[CALIBRATION_BYTES * 18 + 10];
+	int r = 0;
+
+	if (g_cfg.transport->calibrate)
+		return g_cfg.transport->calibrate(stats);
+
+	g_ack_record.samples = samples;
+	g_ack_record.count = 0;
+	g_ack_record.max = sizeof(samples) / sizeof(samples[0]);
+	g_cfg.spin_us = MAX_SPIN_US;
+
+	r = init_read_mode(&g_cfg.transport->io);
+	for (uint32_t i = 0; i < CALIBRATION_BYTES && r == 0; ++i) {
+		uint8_t data;
+
+		r = read_byte(&g_cfg.transport->io, &data);
+	}
+	g_ack_record.max = 0;
+	g_cfg.spin_us = 0;
+	if (r || g_ack_record.count == 0)
+		return 1;
+
+	qsort(samples, g_ack_record.count, sizeof(samples[0]), cmp_u32);
+	stats->p50_ns = samples[g_ack_record.count / 2];
+	stats->p99_ns = samples[g_ack_record.count * 99 / 100];
+	stats->max_ns = samples[g_ack_record.count - 1];
+	stats->spin_us = stats->p99_ns * 2 / 1000 + 1;
+	if (stats->spin_us > MAX_SPIN_US)
+		stats->spin_us = MAX_SPIN_US;
+	return 0;
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include "config.h"
+
+/* qsort() comparator of uint32_t */
+int cmp_u32(const void *a, const void *b);
+
+/*
+ * Distribution of the ACK latencies of the chip through g_cfg.transport,
+ * returns -1 if the transport can't measure them
+ */
+int calibrate_handshake(struct ack_stats *stats);
@@ -0,0 +1,137 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "image.h"
+#include "viper_gc.h"
+
+/*
+ * The daemon keeps the last images it was given so that jobs don't read the
+ * same files again and again, files are identified by their path and
+ * reloaded when their size or modification time changes.
+ */
+
+#define IMAGE_CACHE_MAX 8
+
+struct cached_image {
+	struct image image; /* First so that images can be cast back */
+	char path[256];
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	unsigned int refs; /* One is held by the cache while it is listed */
+	struct cached_image *next;
+};
+
+static pthread_mutex_t g_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct cached_image *g_cache; /* Most recently used first */
+
+static void unref(struct cached_image *c)
+{
+	if (--c->refs)
+		return;
+	free(c->image.data);
+	free(c);
+}
+
+static bool unchanged(const struct cached_image *c, const struct stat *st)
+{
+	return c->dev == st->st_dev && c->ino == st->st_ino
+	    && c->size == st->st_size
+	    && c->mtime.tv_sec == st->st_mtim.tv_sec
+	    && c->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+static struct cached_image *load(const char *path, FILE *f,
+				 const struct stat *st)
+{
+	struct cached_image *c = calloc(1, sizeof(*c));
+
+	if (!c || !(c->image.data = malloc(st->st_size ? st->st_size : 1))) {
+		eprintf("Not enough memory to load '%s'\n", path);
+		free(c);
+		return NULL;
+	}
+	if (fread(c->image.data, 1, st->st_size, f) != (size_t) st->st_size) {
+		eprintf("Failed to read all bytes from '%s'\n", path);
+		free(c->image.data);
+		free(c);
+		return NULL;
+	}
+	c->image.size = st->st_size;
+	strncpy(c->path, path, sizeof(c->path) - 1);
+	c->dev = st->st_dev;
+	c->ino = st->st_ino;
+	c->size = st->st_size;
+	c->mtime = st->st_mtim;
+	return c;
+}
+
+const struct image *image_get(const char *path)
+{
+	struct cached_image *c, *got, **prev;
+	unsigned int listed = 0;
+	struct stat st;
+	FILE *f = fopen(path, "rb");
+
+	if (!f || fstat(fileno(f), &st)) {
+		eprintf("Could not open file '%s'\n", path);
+		if (f)
+			fclose(f);
+		return NULL;
+	}
+	if (st.st_size > BIOS_SIZE) {
+		eprintf("File '%s' of size %zu won't fit on the chip\n", path,
+			(size_t) st.st_size);
+		fclose(f);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&g_cache_lock);
+	for (prev = &g_cache; (c = *prev); prev = &c->next) {
+		if (strcmp(c->path, path) == 0)
+			break;
+	}
+	if (c) {
+		*prev = c->next;
+		if (!unchanged(c, &st)) {
+			unref(c);
+			c = NULL;
+		}
+	}
+	if (!c && (c = load(path, f, &st)))
+		c->refs = 1;
+	fclose(f);
+	if (!c) {
+		pthread_mutex_unlock(&g_cache_lock);
+		return NULL;
+	}
+	++c->refs;
+	c->next = g_cache;
+	g_cache = got = c;
+
+	/* Drop the least recently used images past the limit */
+	for (prev = &g_cache; (c = *prev); ) {
+		if (++listed > IMAGE_CACHE_MAX) {
+			*prev = c->next;
+			unref(c);
+		} else {
+			prev = &c->next;
+		}
+	}
+	pthread_mutex_unlock(&g_cache_lock);
+	return &got->image;
+}
+
+void image_put(const struct image *image)
+{
+	if (!image)
+		return;
+	pthread_mutex_lock(&g_cache_lock);
+	unref((struct cached_image *) image);
+	pthread_mutex_unlock(&g_cache_lock);
+}
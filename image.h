@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Content of a file to write or compare with, shared read-only */
+struct image {
+	uint8_t *data;
+	size_t size;
+};
+
+/*
+ * Loads the file at path, or returns the copy already in memory if the file
+ * didn't change since. Every image_get() is paired with an image_put(), the
+ * cache frees the images that were replaced or evicted once they are unused.
+ */
+const struct image *image_get(const char *path);
+void image_put(const struct image *image);
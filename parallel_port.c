@@ -0,0 +1,84 @@
+#include <stdio.h>
+#include <sys/io.h>
+
+#include "config.h"
+#include "transport.h"
+#include "viper_gc.h"
+
+/*
+ * Raw parallel port backend: the data register is at the base address of the
+ * port and the status register right after it.
+ */
+
+static void parallel_outb(uint8_t data)
+{
+	outb(data, g_cfg.port);
+}
+
+static uint8_t parallel_inb(void)
+{
+	return inb(g_cfg.port + 1);
+}
+
+static const struct port_io PARALLEL_IO = {
+	.outb = parallel_outb,
+	.inb = parallel_inb,
+};
+
+static int parallel_init(void)
+{
+	if (ioperm(g_cfg.port, 2, 1)) {
+		eprintf("Unable to acquire permissions for port 0x%x, give "
+			"yourself permission or try running as root.\n",
+			g_cfg.port);
+		return 1;
+	}
+	return 0;
+}
+
+static int parallel_read_range(uint8_t *data, uint32_t size)
+{
+	return chip_read_range(&PARALLEL_IO, data, size);
+}
+
+static int parallel_write_range(const uint8_t *data, uint32_t offset,
+				uint32_t size, uint32_t *failed_at)
+{
+	return chip_write_range(&PARALLEL_IO, data, offset, size, failed_at);
+}
+
+static int parallel_verify_range(const uint8_t *expect, uint32_t size,
+				 uint32_t max_diffs, uint32_t *first_diff,
+				 uint32_t *diffs)
+{
+	return chip_verify_range(&PARALLEL_IO, expect, size, max_diffs,
+				 first_diff, diffs);
+}
+
+static int parallel_erase(uint32_t *elapsed_ms)
+{
+	return erase_and_wait(&PARALLEL_IO, elapsed_ms);
+}
+
+static int parallel_set_fast(bool fast)
+{
+	/* Pacing needs the handshake to be calibrated */
+	if (fast && g_cfg.spin_us == 0)
+		return 1;
+	g_cfg.paced = fast;
+	return 0;
+}
+
+const struct transport parallel_transport = {
+	.name = "parallel port",
+	.init = parallel_init,
+	.io = {
+		.outb = parallel_outb,
+		.inb = parallel_inb,
+	},
+	.read_range = parallel_read_range,
+	.write_range = parallel_write_range,
+	.verify_range = parallel_verify_range,
+	.erase = parallel_erase,
+	.set_fast = parallel_set_fast,
+};
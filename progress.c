@@ -0,0 +1,50 @@
+#include <stdio.h>
+#include <time.h>
+
+#include "progress.h"
+
+static _Thread_local struct {
+	struct timespec start; /* Of the operation */
+	uint64_t next_ns; /* Since start, when the line can be printed again */
+	uint32_t done;
+	uint32_t total;
+} g_line;
+
+static uint64_t since(const struct timespec *start, const struct timespec *now)
+{
+	return (uint64_t) (now->tv_sec - start->tv_sec) * 1000000000
+		+ now->tv_nsec - start->tv_nsec;
+}
+
+void progress_report(uint32_t done, uint32_t total)
+{
+	struct timespec now;
+	uint64_t elapsed;
+	double rate;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	/* Going back or a new total means another operation started */
+	if (total != g_line.total || done < g_line.done) {
+		g_line.start = now;
+		g_line.next_ns = 0;
+		g_line.total = total;
+	} else if (done == g_line.done) {
+		return;
+	}
+	g_line.done = done;
+	elapsed = since(&g_line.start, &now);
+	if (total == 0 || (done < total && elapsed < g_line.next_ns))
+		return;
+	g_line.next_ns = elapsed + PROGRESS_REFRESH_MS * 1000000ULL;
+
+	rate = elapsed ? done * 1e9 / elapsed : 0; /* Bytes/s */
+	printf("\r%06u/%06u bytes, %3u%%", done, total,
+	       (uint32_t) ((uint64_t) done * 100 / total));
+	if (rate >= 1000)
+		printf(", %.1f KB/s", rate / 1000);
+	else if (rate > 0)
+		printf(", %.0f B/s", rate);
+	if (rate > 0)
+		printf(", ETA %us   ", (uint32_t) ((total - done) / rate));
+	fflush(stdout);
+}
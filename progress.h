@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Progress line of the operation running in the calling thread, with its
+ * throughput and ETA. It is printed at most every PROGRESS_REFRESH_MS (and
+ * once complete) so the terminal never slows the transfers down.
+ */
+#define PROGRESS_REFRESH_MS 100
+
+void progress_report(uint32_t done, uint32_t total);
@@ -0,0 +1,76 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+
+#include "config.h"
+#include "realtime.h"
+
+/* Below the interrupt threads of PREEMPT_RT kernels, USB serial needs them */
+#define RT_PRIORITY 49
+
+static pthread_mutex_t g_cpus_lock = PTHREAD_MUTEX_INITIALIZER;
+static cpu_set_t g_claimed_cpus;
+static _Thread_local int g_cpu = -1;
+
+/*
+ * A CPU of its own for the calling thread, one is always left for the rest
+ * of the system and the receive threads. Returns -1 if there is none left.
+ * The daemon enters again when it reopens a device, it keeps its CPU.
+ */
+static int claim_cpu(void)
+{
+	cpu_set_t allowed;
+
+	if (g_cpu >= 0)
+		return g_cpu;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed))
+		return -1;
+	pthread_mutex_lock(&g_cpus_lock);
+	if (CPU_COUNT(&g_claimed_cpus) + 1 < CPU_COUNT(&allowed)) {
+		for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+			if (CPU_ISSET(cpu, &allowed)
+			    && !CPU_ISSET(cpu, &g_claimed_cpus)) {
+				CPU_SET(cpu, &g_claimed_cpus);
+				g_cpu = cpu;
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&g_cpus_lock);
+	return g_cpu;
+}
+
+void realtime_enter(bool shared)
+{
+	struct sched_param param = {
+		.sched_priority = RT_PRIORITY,
+	};
+	int cpu = shared ? claim_cpu() : sched_getcpu();
+
+	/* Busy polling with real-time priority would starve the others */
+	if (shared && cpu < 0) {
+		eprintf("No CPU left for low latency mode, running without\n");
+		return;
+	}
+	if (sched_setscheduler(0, SCHED_FIFO, &param))
+		eprintf("Couldn't get real-time priority: %s\n",
+			strerror(errno));
+	if (mlockall(MCL_CURRENT | MCL_FUTURE))
+		eprintf("Couldn't lock memory: %s\n", strerror(errno));
+	/* Timer slack is in ns, 0 would restore the default of 50us */
+	if (prctl(PR_SET_TIMERSLACK, 1UL, 0UL, 0UL, 0UL))
+		eprintf("Couldn't reduce timer slack: %s\n", strerror(errno));
+	if (cpu >= 0) {
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (sched_setaffinity(0, sizeof(set), &set))
+			eprintf("Couldn't pin to CPU %d: %s\n", cpu,
+				strerror(errno));
+	}
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stdbool.h>
+
+/*
+ * Low latency mode (-L) for the calling thread: real-time priority, memory
+ * locked, pinned to its CPU and with a minimal timer slack so that the
+ * handshake sleeps of safe_mode_check() end when they should. Applies what
+ * it can and warns about the rest, which usually needs root.
+ *
+ * shared when other devices are driven by threads of the same process, each
+ * one is then pinned to a CPU of its own and one CPU is left to the rest.
+ * The threads that don't get one run without real-time priority.
+ */
+void realtime_enter(bool shared);
@@ -0,0 +1,56 @@
+#include <stdint.h>
+
+/*
+ * Kept apart from arduino_serial.c: on Linux, arbitrary rates need termios2
+ * whose header can't be included along with the one of the libc.
+ */
+#ifdef __linux__
+#include <asm/termbits.h>
+#include <sys/ioctl.h>
+#else
+#include <termios.h>
+#endif
+
+#include "serial_speed.h"
+
+int serial_set_speed(int fd, uint32_t baud)
+{
+#ifdef __linux__
+	struct termios2 tio;
+
+	if (ioctl(fd, TCGETS2, &tio))
+		return 1;
+	tio.c_cflag &= ~(CBAUD | CBAUD << IBSHIFT);
+	tio.c_cflag |= BOTHER | BOTHER << IBSHIFT;
+	tio.c_ispeed = baud;
+	tio.c_ospeed = baud;
+	return ioctl(fd, TCSETS2, &tio) != 0;
+#else
+	/* The BSDs and macOS take the rate itself as speed_t */
+	struct termios tty;
+
+	if (tcgetattr(fd, &tty) || cfsetspeed(&tty, baud))
+		return 1;
+	return tcsetattr(fd, TCSANOW, &tty) != 0;
+#endif
+}
+
+int serial_get_speed(int fd, uint32_t *baud)
+{
+#ifdef __linux__
+	struct termios2 tio;
+
+	/* The kernel fills c_ospeed for the standard rates too */
+	if (ioctl(fd, TCGETS2, &tio))
+		return 1;
+	*baud = tio.c_ospeed;
+	return 0;
+#else
+	struct termios tty;
+
+	if (tcgetattr(fd, &tty))
+		return 1;
+	*baud = cfgetospeed(&tty);
+	return 0;
+#endif
+}
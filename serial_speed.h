@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Rates of serial devices beyond the standard ones. Plain C so that the bridge
+ * emulator can tell the rate the loader set on its PTY too.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Sets any rate the adapter supports, not only the standard ones */
+int serial_set_speed(int fd, uint32_t baud);
+/* Output rate of fd, the one of the slave side for the master of a PTY */
+int serial_get_speed(int fd, uint32_t *baud);
+
+#ifdef __cplusplus
+}
+#endif
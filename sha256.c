@@ -0,0 +1,91 @@
+#include "sha256.h"
+
+#include <string.h>
+
+static const uint32_t K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+	0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+	0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+	0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+	0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+	0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline uint32_t ror(uint32_t x, unsigned int n)
+{
+	return x >> n | x << (32 - n);
+}
+
+static void sha256_block(uint32_t state[8], const uint8_t *block)
+{
+	uint32_t w[64], s[8];
+
+	for (unsigned int i = 0; i < 16; ++i)
+		w[i] = (uint32_t) block[i * 4] << 24
+			| (uint32_t) block[i * 4 + 1] << 16
+			| (uint32_t) block[i * 4 + 2] << 8 | block[i * 4 + 3];
+	for (unsigned int i = 16; i < 64; ++i)
+		w[i] = w[i - 16] + w[i - 7]
+			+ (ror(w[i - 15], 7) ^ ror(w[i - 15], 18) ^ w[i - 15] >> 3)
+			+ (ror(w[i - 2], 17) ^ ror(w[i - 2], 19) ^ w[i - 2] >> 10);
+
+	memcpy(s, state, sizeof(s));
+	for (unsigned int i = 0; i < 64; ++i) {
+		uint32_t t1 = s[7] + (ror(s[4], 6) ^ ror(s[4], 11) ^ ror(s[4], 25))
+			+ ((s[4] & s[5]) ^ (~s[4] & s[6])) + K[i] + w[i];
+		uint32_t t2 = (ror(s[0], 2) ^ ror(s[0], 13) ^ ror(s[0], 22))
+			+ ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+
+		memmove(&s[1], &s[0], 7 * sizeof(s[0]));
+		s[4] += t1;
+		s[0] = t1 + t2;
+	}
+	for (unsigned int i = 0; i < 8; ++i)
+		state[i] += s[i];
+}
+
+void sha256_init(struct sha256 *ctx)
+{
+	static const uint32_t H0[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+
+	memcpy(ctx->state, H0, sizeof(H0));
+	ctx->size = 0;
+}
+
+void sha256_update(struct sha256 *ctx, const uint8_t *data, size_t size)
+{
+	while (size) {
+		size_t used = ctx->size % 64;
+		size_t n = size < 64 - used ? size : 64 - used;
+
+		memcpy(&ctx->block[used], data, n);
+		ctx->size += n;
+		data += n;
+		size -= n;
+		if (used + n == 64)
+			sha256_block(ctx->state, ctx->block);
+	}
+}
+
+void sha256_final(struct sha256 *ctx, uint8_t digest[SHA256_SIZE])
+{
+	static const uint8_t PADDING[64] = {0x80};
+	uint64_t bits = ctx->size * 8;
+	uint8_t length[8];
+
+	for (unsigned int i = 0; i < 8; ++i)
+		length[i] = bits >> (56 - i * 8);
+	/* Up to 56 bytes modulo 64, then the length in bits */
+	sha256_update(ctx, PADDING, 1 + (119 - ctx->size % 64) % 64);
+	sha256_update(ctx, length, sizeof(length));
+	for (unsigned int i = 0; i < SHA256_SIZE; ++i)
+		digest[i] = ctx->state[i / 4] >> (24 - i % 4 * 8);
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* SHA-256 (FIPS 180-4), fed incrementally */
+#define SHA256_SIZE 32
+
+struct sha256 {
+	uint32_t state[8];
+	uint64_t size; /* Bytes hashed so far */
+	uint8_t block[64];
+};
+
+void sha256_init(struct sha256 *ctx);
+void sha256_update(struct sha256 *ctx, const uint8_t *data, size_t size);
+void sha256_final(struct sha256 *ctx, uint8_t digest[SHA256_SIZE]);
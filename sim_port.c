@@ -0,0 +1,166 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "transport.h"
+#include "viper_gc.h"
+#include "viper_sim.h"
+
+/*
+ * Simulated chip backend, driven like the parallel port but without any
+ * hardware. It is configured by "state_file[,latency=ns][,erase=ms]
+ * [,fail=n][,drop=n][,seed=1]": the content of the chip is loaded from
+ * state_file if it exists and saved back into it once done, fail makes the
+ * nth write command stall the chip and drop makes it ignore the nth one.
+ * seed=1 makes the pentads after the read init command set the address.
+ */
+
+static _Thread_local struct viper_sim g_sim;
+static _Thread_local char g_state_path[sizeof(g_cfg.sim_spec)];
+
+static void sim_outb(uint8_t data)
+{
+	viper_sim_outb(&g_sim, data);
+}
+
+static uint8_t sim_inb(void)
+{
+	return viper_sim_status(&g_sim);
+}
+
+static const struct port_io SIM_IO = {
+	.outb = sim_outb,
+	.inb = sim_inb,
+};
+
+static int parse_sim_option(const char *option)
+{
+	const struct {
+		const char *name;
+		uint32_t *value;
+	} OPTIONS[] = {
+		{"latency=", &g_sim.ack_latency_ns},
+		{"erase=", &g_sim.erase_ms},
+		{"fail=", &g_sim.fail_write},
+		{"drop=", &g_sim.drop_write},
+		{"seed=", &g_sim.seed_read},
+	};
+
+	for (size_t i = 0; i < sizeof(OPTIONS) / sizeof(OPTIONS[0]); ++i) {
+		size_t len = strlen(OPTIONS[i].name);
+		char *endptr;
+		unsigned long val;
+
+		if (strncmp(option, OPTIONS[i].name, len))
+			continue;
+		val = strtoul(option + len, &endptr, 0);
+		if (*endptr != '\0' || endptr == option + len
+		    || val > UINT32_MAX)
+			return 1;
+		*OPTIONS[i].value = val;
+		return 0;
+	}
+	return 1;
+}
+
+static int sim_init(void)
+{
+	char spec[sizeof(g_cfg.sim_spec)], *options, *option, *save;
+	FILE *f;
+
+	viper_sim_init(&g_sim);
+	strcpy(spec, g_cfg.sim_spec);
+	/* The state file comes first, options can't stand in for it */
+	options = strchr(spec, ',');
+	if (options)
+		*options++ = '\0';
+	else
+		options = spec + strlen(spec);
+	if (spec[0] == '\0') {
+		eprintf("No state file in simulator spec '%s'\n",
+			g_cfg.sim_spec);
+		return 1;
+	}
+	if (strlen(spec) >= sizeof(g_state_path)) {
+		eprintf("Simulator state path is too long\n");
+		return 1;
+	}
+	snprintf(g_state_path, sizeof(g_state_path), "%s", spec);
+	for (option = strtok_r(options, ",", &save); option;
+	     option = strtok_r(NULL, ",", &save)) {
+		if (parse_sim_option(option)) {
+			eprintf("Unknown simulator option '%s'\n", option);
+			return 1;
+		}
+	}
+
+	f = fopen(g_state_path, "rb");
+	if (f) {
+		if (fread(g_sim.flash, 1, sizeof(g_sim.flash), f) == 0)
+			memset(g_sim.flash, 0xff, sizeof(g_sim.flash));
+		fclose(f);
+	}
+	printf("Simulated chip in '%s', ACKs in %uns\n", g_state_path,
+	       g_sim.ack_latency_ns);
+	return 0;
+}
+
+static int sim_read_range(uint8_t *data, uint32_t size)
+{
+	return chip_read_range(&SIM_IO, data, size);
+}
+
+static int sim_write_range(const uint8_t *data, uint32_t offset,
+			   uint32_t size, uint32_t *failed_at)
+{
+	return chip_write_range(&SIM_IO, data, offset, size, failed_at);
+}
+
+static int sim_verify_range(const uint8_t *expect, uint32_t size,
+			    uint32_t max_diffs, uint32_t *first_diff,
+			    uint32_t *diffs)
+{
+	return chip_verify_range(&SIM_IO, expect, size, max_diffs, first_diff,
+				 diffs);
+}
+
+static int sim_erase(uint32_t *elapsed_ms)
+{
+	return erase_and_wait(&SIM_IO, elapsed_ms);
+}
+
+static int sim_set_fast(bool fast)
+{
+	if (fast && g_cfg.spin_us == 0)
+		return 1;
+	g_cfg.paced = fast;
+	return 0;
+}
+
+static void sim_close(void)
+{
+	FILE *f = fopen(g_state_path, "wb");
+
+	if (!f || fwrite(g_sim.flash, 1, sizeof(g_sim.flash), f)
+		  != sizeof(g_sim.flash))
+		eprintf("Couldn't save the simulated chip to '%s'\n",
+			g_state_path);
+	if (f)
+		fclose(f);
+}
+
+const struct transport sim_transport = {
+	.name = "simulator",
+	.init = sim_init,
+	.io = {
+		.outb = sim_outb,
+		.inb = sim_inb,
+	},
+	.read_range = sim_read_range,
+	.write_range = sim_write_range,
+	.verify_range = sim_verify_range,
+	.erase = sim_erase,
+	.set_fast = sim_set_fast,
+	.close = sim_close,
+};
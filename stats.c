@@ -0,0 +1,159 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "config.h"
+#include "stats.h"
+#include "transport.h"
+
+_Thread_local struct stats g_stats;
+
+/* Shared by all the workers, each report is written at once */
+static FILE *g_report;
+static pthread_mutex_t g_report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *const OPERATIONS[] = {
+	[OP_UNSET] = "none",
+	[OP_READ] = "read",
+	[OP_WRITE] = "write",
+	[OP_COMPARE] = "compare",
+	[OP_VERIFY] = "verify",
+	[OP_LINK_TEST] = "link_test",
+};
+
+static const char *const PHASES[] = {
+	[PHASE_CALIBRATE] = "calibrate",
+	[PHASE_ERASE] = "erase",
+	[PHASE_READ] = "read",
+	[PHASE_WRITE] = "write",
+	[PHASE_COMPARE] = "compare",
+	[PHASE_CHECKSUM] = "checksum",
+};
+
+int stats_open(const char *path)
+{
+	g_report = fopen(path, "w");
+	if (!g_report) {
+		eprintf("Couldn't create stats file '%s'\n", path);
+		return 1;
+	}
+	/* Every line is complete on its own, even if the loader is killed */
+	setvbuf(g_report, NULL, _IOLBF, 0);
+	return 0;
+}
+
+void stats_reset(void)
+{
+	memset(&g_stats, 0, sizeof(g_stats));
+	g_stats.timed = g_report != NULL;
+	clock_gettime(CLOCK_MONOTONIC, &g_stats.start);
+}
+
+void stats_phase(enum stats_phase phase, uint32_t bytes,
+		 const struct timespec *start)
+{
+	++g_stats.phases[phase].count;
+	g_stats.phases[phase].bytes += bytes;
+	g_stats.phases[phase].ns += elapsed_ns(start);
+}
+
+static double seconds(uint64_t ns)
+{
+	return ns / 1e9;
+}
+
+/* Device names are paths, only quotes and backslashes need escaping */
+static void print_string(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for (; *s; ++s) {
+		if (*s == '"' || *s == '\\')
+			fputc('\\', f);
+		if ((unsigned char) *s >= 0x20)
+			fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+static void print_acks(FILE *f)
+{
+	bool first = true;
+
+	fprintf(f, "\"acks\":{\"tiers\":[");
+	for (unsigned int i = 0; i < ACK_TIERS; ++i)
+		fprintf(f, "%s%llu", i ? "," : "",
+			(unsigned long long) g_stats.acks[i]);
+	fprintf(f, "],\"timeouts\":%llu,\"wait_s\":%.6f,\"latency_ns\":[",
+		(unsigned long long) g_stats.ack_timeouts,
+		seconds(g_stats.chip_wait_ns));
+	/* Only the buckets that were hit, by upper bound */
+	for (unsigned int i = 0; i < ACK_BUCKETS; ++i) {
+		if (g_stats.ack_latency[i] == 0)
+			continue;
+		if (i == ACK_BUCKETS - 1)
+			fprintf(f, "%s{\"below\":null", first ? "" : ",");
+		else
+			fprintf(f, "%s{\"below\":%llu", first ? "" : ",",
+				1ULL << i);
+		fprintf(f, ",\"count\":%llu}",
+			(unsigned long long) g_stats.ack_latency[i]);
+		first = false;
+	}
+	fprintf(f, "]}");
+}
+
+static void print_phases(FILE *f)
+{
+	bool first = true;
+
+	fprintf(f, "\"phases\":{");
+	for (unsigned int i = 0; i < PHASE_COUNT; ++i) {
+		double s = seconds(g_stats.phases[i].ns);
+
+		if (g_stats.phases[i].count == 0)
+			continue;
+		fprintf(f, "%s\"%s\":{\"count\":%llu,\"bytes\":%llu,"
+			"\"seconds\":%.6f,\"bytes_per_s\":%.0f}",
+			first ? "" : ",", PHASES[i],
+			(unsigned long long) g_stats.phases[i].count,
+			(unsigned long long) g_stats.phases[i].bytes, s,
+			s > 0 ? g_stats.phases[i].bytes / s : 0);
+		first = false;
+	}
+	fprintf(f, "}");
+}
+
+void stats_dump(const char *device, int status)
+{
+	FILE *f = g_report;
+
+	if (!f)
+		return;
+	pthread_mutex_lock(&g_report_lock);
+	fprintf(f, "{\"device\":");
+	print_string(f, device);
+	fprintf(f, ",\"transport\":\"%s\",\"operation\":\"%s\",\"ok\":%s,"
+		"\"low_latency\":%s,\"seconds\":%.6f,\"pentads\":%llu,",
+		g_cfg.transport ? g_cfg.transport->name : "none",
+		OPERATIONS[g_cfg.operation], status ? "false" : "true",
+		g_cfg.low_latency ? "true" : "false",
+		seconds(elapsed_ns(&g_stats.start)),
+		(unsigned long long) g_stats.pentads);
+	print_acks(f);
+	fprintf(f, ",\"erase\":{\"polls\":%llu,\"settle_s\":%.6f}",
+		(unsigned long long) g_stats.erase_polls,
+		seconds(g_stats.erase_settle_ns));
+	fprintf(f, ",\"uart\":{\"tx_bytes\":%llu,\"rx_bytes\":%llu,"
+		"\"send_s\":%.6f,\"wait_s\":%.6f,\"waits\":%llu,"
+		"\"timeouts\":%llu,\"frames\":%llu,\"credit_stalls\":%llu},",
+		(unsigned long long) g_stats.tx_bytes,
+		(unsigned long long) g_stats.rx_bytes,
+		seconds(g_stats.uart_send_ns), seconds(g_stats.uart_wait_ns),
+		(unsigned long long) g_stats.uart_waits,
+		(unsigned long long) g_stats.uart_timeouts,
+		(unsigned long long) g_stats.frames,
+		(unsigned long long) g_stats.credit_stalls);
+	print_phases(f);
+	fprintf(f, "}\n");
+	pthread_mutex_unlock(&g_report_lock);
+}
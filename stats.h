@@ -0,0 +1,106 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Counters of the hot paths, reported with -j. They are always counted,
+ * the waits are only timed when a report was asked for since that costs a
+ * clock_gettime() per ACK.
+ */
+
+/* Polling, then after each of the 125us, 250us and 500us sleeps */
+#define ACK_TIERS 4
+/* Powers of two of the ACK latency in ns, the last one is for the slower */
+#define ACK_BUCKETS 24
+
+enum stats_phase {
+	PHASE_CALIBRATE,
+	PHASE_ERASE,
+	PHASE_READ,
+	PHASE_WRITE,
+	PHASE_COMPARE,
+	PHASE_CHECKSUM,
+	PHASE_COUNT,
+};
+
+struct stats {
+	bool timed;
+	struct timespec start;
+	uint64_t pentads;
+	uint64_t acks[ACK_TIERS]; /* By how long it took the chip */
+	uint64_t ack_timeouts;
+	uint64_t ack_latency[ACK_BUCKETS];
+	uint64_t chip_wait_ns; /* Blocked in safe_mode_check() */
+	uint64_t erase_polls; /* Reads until the erase is over */
+	uint64_t erase_settle_ns; /* Then until the chip reads as blank */
+	/* Serial link */
+	uint64_t tx_bytes;
+	uint64_t rx_bytes;
+	uint64_t uart_send_ns;
+	uint64_t uart_wait_ns; /* Blocked waiting for the bridge to reply */
+	uint64_t uart_waits;
+	uint64_t uart_timeouts;
+	uint64_t frames; /* Chunks and extents of the write streams */
+	uint64_t credit_stalls; /* Waits with the window of extents full */
+	struct {
+		uint64_t count;
+		uint64_t bytes;
+		uint64_t ns;
+	} phases[PHASE_COUNT];
+};
+
+/* Each worker of the farm mode has its own */
+extern _Thread_local struct stats g_stats;
+
+static inline uint64_t elapsed_ns(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) (now.tv_sec - start->tv_sec) * 1000000000
+		+ now.tv_nsec - start->tv_nsec;
+}
+
+/* Starts timing something, only when a report was asked for */
+static inline void stats_start(struct timespec *start)
+{
+	if (g_stats.timed)
+		clock_gettime(CLOCK_MONOTONIC, start);
+}
+
+static inline uint64_t stats_stop(const struct timespec *start)
+{
+	return g_stats.timed ? elapsed_ns(start) : 0;
+}
+
+/* The chip ACKed at tier after ns, ns is only meaningful when timed */
+static inline void stats_ack(unsigned int tier, uint64_t ns)
+{
+	unsigned int bucket = 0;
+
+	++g_stats.acks[tier];
+	if (!g_stats.timed)
+		return;
+	g_stats.chip_wait_ns += ns;
+	while (bucket < ACK_BUCKETS - 1 && ns >> bucket)
+		++bucket;
+	++g_stats.ack_latency[bucket];
+}
+
+static inline void stats_ack_timeout(uint64_t ns)
+{
+	++g_stats.ack_timeouts;
+	g_stats.chip_wait_ns += ns;
+}
+
+/* Opens the report, one JSON object per line is added to it for each job */
+int stats_open(const char *path);
+/* Clears the counters of the calling thread before a new job */
+void stats_reset(void);
+/* Time spent at phase since start, always counted */
+void stats_phase(enum stats_phase phase, uint32_t bytes,
+		 const struct timespec *start);
+/* Appends the counters of the calling thread to the report, if open */
+void stats_dump(const char *device, int status);
@@ -0,0 +1,248 @@
+#!/bin/sh
+#
+# Runs viper_loader against the simulated chip (-E) and the sketch running in
+# bridge_emu, bridge_emu_usb and bridge_emu_mega, and checks the exit status,
+# the messages and the content of the chip after each scenario. Run it from
+# the top of the tree with `make check`, it stops at the first failure.
+#
+
+LOADER=./viper_loader
+EMU=bridge_emu/bridge_emu
+EMU_USB=bridge_emu/bridge_emu_usb
+EMU_MEGA=bridge_emu/bridge_emu_mega
+
+tmp=$(mktemp -d /tmp/viper_check.XXXXXX) || exit 1
+tty=$tmp/tty
+emu_pid=
+trap 'test -n "$emu_pid" && kill $emu_pid && wait $emu_pid; rm -rf "$tmp"' EXIT
+
+fail()
+{
+	echo "FAIL: $*"
+	test -f "$tmp/out" && sed 's/^/    /' "$tmp/out"
+	exit 1
+}
+
+# Runs the loader and expects it to exit with status $1
+run()
+{
+	want=$1
+	shift
+	timeout 300 $LOADER "$@" > "$tmp/out" 2>&1
+	r=$?
+	test $r -eq $want || fail "$LOADER $* returned $r instead of $want"
+}
+
+# The output of the last run contains the fixed string $1
+says()
+{
+	grep -qF -- "$1" "$tmp/out" || fail "no \"$1\" in the output"
+}
+
+# The chip content $1 starts with the content of $2
+holds()
+{
+	cmp -s -n $(wc -c < "$2") "$1" "$2" || fail "$1 doesn't hold $2"
+}
+
+# Writes the byte $3 (octal) at offset $2 of file $1
+poke()
+{
+	printf "\\$3" | dd of="$1" bs=1 seek=$2 conv=notrunc 2>/dev/null
+}
+
+# Starts emulator $1 with options $2.., its chip is dumped into $tmp/dump
+emu_start()
+{
+	bin=$1
+	shift
+	rm -f "$tmp/dump"*
+	$bin -L "$tty" -d "$tmp/dump" "$@" > /dev/null 2> "$tmp/emu_err" &
+	emu_pid=$!
+	for i in 1 2 3 4 5 6 7 8 9 10; do
+		test -e "$tty" && return
+		sleep 0.1
+	done
+	fail "$bin didn't create $tty"
+}
+
+# Stops the emulator, which fails if it dropped received bytes
+emu_stop()
+{
+	kill $emu_pid
+	wait $emu_pid
+	r=$?
+	emu_pid=
+	test $r -eq 0 || fail "$bin exited with $r: $(cat "$tmp/emu_err")"
+}
+
+# Dense data, a blank hole the streams skip and a dense tail
+head -c 8192 /dev/urandom > "$tmp/ref.bin"
+head -c 8192 /dev/zero | tr '\0' '\377' >> "$tmp/ref.bin"
+head -c 16384 /dev/urandom >> "$tmp/ref.bin"
+for a in 256 257 258 259 768 12288 24576; do
+	poke "$tmp/ref.bin" $a 132
+done
+# Programmed bytes set back to 0xff, they don't need an erase
+cp "$tmp/ref.bin" "$tmp/holes.bin"
+for a in 256 257 258 259 24576; do
+	poke "$tmp/holes.bin" $a 377
+done
+# A bit set to 0 where the image has it to 1, it needs an erase
+cp "$tmp/ref.bin" "$tmp/zero.bin"
+poke "$tmp/zero.bin" 768 0
+head -c 4096 "$tmp/ref.bin" | tail -c 1024 > "$tmp/window.bin"
+
+echo "simulator: write, verify, compare and read"
+run 0 -E "$tmp/sim.bin" -w "$tmp/ref.bin"
+holds "$tmp/sim.bin" "$tmp/ref.bin"
+run 0 -E "$tmp/sim.bin" -v "$tmp/ref.bin"
+says "File and memory checksums match."
+run 0 -E "$tmp/sim.bin" -c "$tmp/ref.bin"
+says "File and memory are identical."
+run 0 -E "$tmp/sim.bin" -l 32768 -r "$tmp/read.bin"
+holds "$tmp/read.bin" "$tmp/ref.bin"
+
+echo "simulator: windows with and without an address seed"
+for seed in 0 1; do
+	run 0 -E "$tmp/sim.bin,seed=$seed" -o 3072 -l 1024 -c "$tmp/window.bin"
+	says "File and memory are identical."
+	run 0 -E "$tmp/sim.bin,seed=$seed" -o 3072 -l 1024 -r "$tmp/read.bin"
+	holds "$tmp/read.bin" "$tmp/window.bin"
+done
+
+echo "simulator: stalled write, resume and dropped write in fast mode"
+rm -f "$tmp/sim.bin"
+run 1 -E "$tmp/sim.bin,fail=300" -w "$tmp/ref.bin"
+says "Run again with -R"
+resume=$(sed -n 's/.*Run again with -R \(0x[0-9a-f]*\).*/\1/p' "$tmp/out")
+run 0 -E "$tmp/sim.bin" -R $resume -w "$tmp/ref.bin"
+holds "$tmp/sim.bin" "$tmp/ref.bin"
+rm -f "$tmp/sim.bin"
+run 0 -E "$tmp/sim.bin,drop=500" -f -w "$tmp/ref.bin"
+says "block(s) to program again in safe mode"
+holds "$tmp/sim.bin" "$tmp/ref.bin"
+
+echo "simulator: differences, only counted without a bridge"
+cp "$tmp/holes.bin" "$tmp/sim.bin"
+run 1 -E "$tmp/sim.bin" -m 0 -c "$tmp/ref.bin"
+says "First difference found at address 0x00100"
+says "5 difference(s) found"
+run 0 -E "$tmp/sim.bin" -d -w "$tmp/ref.bin"
+says "5 byte(s) to program, no need to erase"
+holds "$tmp/sim.bin" "$tmp/ref.bin"
+
+echo "simulator: spec without a state file"
+run 1 -E ",seed=1" -r "$tmp/read.bin"
+says "No state file in simulator spec"
+
+echo "daemon: only a stale socket is removed"
+touch "$tmp/sock"
+run 1 -E "$tmp/sim.bin" -D "$tmp/sock"
+says "exists and isn't a socket"
+test -f "$tmp/sock" || fail "the daemon removed $tmp/sock"
+
+echo "bridge_emu: write, verify, compare and read"
+emu_start $EMU -b 1000000
+run 0 -s "$tty" -w "$tmp/ref.bin"
+run 0 -s "$tty" -v "$tmp/ref.bin"
+says "File and memory checksums match."
+run 0 -s "$tty" -c "$tmp/ref.bin"
+says "File and memory are identical."
+run 0 -s "$tty" -l 32768 -r "$tmp/read.bin"
+holds "$tmp/read.bin" "$tmp/ref.bin"
+run 0 -s "$tty" -o 3072 -l 1024 -c "$tmp/window.bin"
+says "File and memory are identical."
+emu_stop
+holds "$tmp/dump" "$tmp/ref.bin"
+
+echo "bridge_emu: rate set back when closing, found again after a kill"
+emu_start $EMU -b 1000000 -i "$tmp/ref.bin"
+for i in 1 2; do
+	run 0 -s "$tty" -v "$tmp/ref.bin"
+	says "at 4000000 bauds"
+	last=$(grep '^bridge_emu: [0-9]* bauds$' "$tmp/emu_err" | tail -n 1)
+	test "$last" = "bridge_emu: 1000000 bauds" || fail "left at $last"
+done
+$LOADER -s "$tty" -D "$tmp/daemon.sock" > "$tmp/out" 2>&1 &
+daemon_pid=$!
+for i in $(seq 50); do
+	grep -q "ready" "$tmp/out" && break
+	sleep 0.1
+done
+kill -9 $daemon_pid
+wait $daemon_pid 2>/dev/null
+run 0 -s "$tty" -v "$tmp/ref.bin"
+says "File and memory checksums match."
+emu_stop
+
+echo "bridge_emu: blank check from the block CRCs"
+emu_start $EMU -b 1000000
+run 0 -s "$tty" -b -w "$tmp/ref.bin"
+says "Chip is blank, no need to erase"
+run 0 -s "$tty" -b -w "$tmp/ref.bin"
+says "Address 0x00000 is programmed"
+says "Erasing memory... Done"
+emu_stop
+holds "$tmp/dump" "$tmp/ref.bin"
+
+echo "bridge_emu: window with an address seed"
+emu_start $EMU -b 1000000 -r -i "$tmp/ref.bin"
+run 0 -s "$tty" -o 3072 -l 1024 -r "$tmp/read.bin"
+holds "$tmp/read.bin" "$tmp/window.bin"
+emu_stop
+
+echo "bridge_emu: aborted compare stream"
+emu_start $EMU -b 1000000 -i "$tmp/zero.bin"
+run 1 -s "$tty" -c "$tmp/ref.bin"
+says "First difference found at address 0x00300"
+run 0 -s "$tty" -c "$tmp/zero.bin"
+says "File and memory are identical."
+emu_stop
+
+echo "bridge_emu: difference map and delta write"
+emu_start $EMU -b 1000000 -i "$tmp/holes.bin"
+run 1 -s "$tty" -m 0 -c "$tmp/ref.bin"
+says "0x00100-0x00103 differs"
+says "0x06000-0x06000 differs"
+says "5 difference(s) found in 2 range(s)"
+run 0 -s "$tty" -d -w "$tmp/ref.bin"
+says "5 byte(s) to program, no need to erase"
+emu_stop
+holds "$tmp/dump" "$tmp/ref.bin"
+
+echo "bridge_emu: dropped write in fast mode"
+emu_start $EMU -b 1000000 -g 500
+run 0 -s "$tty" -f -w "$tmp/ref.bin"
+says "block(s) to program again in safe mode"
+emu_stop
+holds "$tmp/dump" "$tmp/ref.bin"
+
+echo "bridge_emu_usb: write, verify and read"
+emu_start $EMU_USB
+run 0 -s "$tty" -w "$tmp/ref.bin"
+run 0 -s "$tty" -v "$tmp/ref.bin"
+says "File and memory checksums match."
+run 0 -s "$tty" -l 32768 -r "$tmp/read.bin"
+holds "$tmp/read.bin" "$tmp/ref.bin"
+emu_stop
+holds "$tmp/dump" "$tmp/ref.bin"
+
+echo "bridge_emu_mega: write all modules, one of them failing"
+emu_start $EMU_MEGA -b 1000000
+run 0 -s "$tty@all" -w "$tmp/ref.bin"
+run 0 -s "$tty@2" -c "$tmp/ref.bin"
+says "File and memory are identical."
+emu_stop
+for m in "" .1 .2 .3; do
+	holds "$tmp/dump$m" "$tmp/ref.bin"
+done
+emu_start $EMU_MEGA -b 1000000 -f 300
+run 1 -s "$tty@all" -w "$tmp/ref.bin"
+says "Module 3 failed to program address"
+emu_stop
+for m in "" .1 .2; do
+	holds "$tmp/dump$m" "$tmp/ref.bin"
+done
+
+echo "All checks passed"
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "config.h"
+#include "viper_gc.h"
+
+/*
+ * A transport drives the parallel module of the Viper GC. Short sequences
+ * (chip init, erase...) go through the raw port accessors while the bulk
+ * operations over the chip memory are implemented by each backend with its
+ * own hot loop.
+ */
+struct transport {
+	const char *name;
+	int (*init)(void);
+	struct port_io io;
+
+	/*
+	 * Bulk operations, the chip must be in read mode at the start of the
+	 * range for read and verify. data[0] is written at address offset, on
+	 * failure everything before failed_at is known to be programmed.
+	 */
+	int (*read_range)(uint8_t *data, uint32_t size);
+	int (*write_range)(const uint8_t *data, uint32_t offset, uint32_t size,
+			   uint32_t *failed_at);
+	/*
+	 * Stops reading the chip after max_diffs differences (0 to compare
+	 * everything), first_diff is set to size if the content matches expect
+	 */
+	int (*verify_range)(const uint8_t *expect, uint32_t size,
+			    uint32_t max_diffs, uint32_t *first_diff,
+			    uint32_t *diffs);
+
+	/*
+	 * Optional, compares the chip with expect (for address offset onwards)
+	 * close to the chip and only gets back the ranges that differ. The
+	 * chip must be in read mode at offset, returns -1 if the device can't.
+	 */
+	int (*diff_range)(const uint8_t *expect, uint32_t offset, uint32_t size,
+			  struct diff_map *map);
+	/*
+	 * Optional, CRC32 of every block_sz bytes (one for the whole range if
+	 * 0) computed close to the chip instead of sending all of its content.
+	 * Returns -1 if the device can't, the chip is left alone then.
+	 */
+	int (*checksum_range)(uint32_t size, uint32_t block_sz, uint32_t *crcs);
+	/* Returns once the chip is blank and ready to be programmed */
+	int (*erase)(uint32_t *elapsed_ms);
+	/*
+	 * Optional, the handshake is timed by the host when NULL. Returns -1
+	 * if the device can't time it, the chip is left alone then.
+	 */
+	int (*calibrate)(struct ack_stats *stats);
+	int (*set_spin)(uint32_t spin_us);
+	/*
+	 * Optional, writes stop waiting for ACKs and leave the chip the
+	 * calibrated handshake time after each strobe edge instead
+	 */
+	int (*set_fast)(bool fast);
+	/* Optional, sends what is still queued */
+	int (*flush)(void);
+	/* Optional, flushes and releases the device */
+	void (*close)(void);
+};
+
+extern const struct transport parallel_transport;
+extern const struct transport serial_transport;
+extern const struct transport sim_transport;
@@ -14,12 +14,94 @@
  *  |  25  (GND)     |  GND         |
  *  +----------------+--------------+
  *
+ * An Arduino Mega drives up to 4 modules instead, see MODULES below.
+ *
  * Commands are read on the serial port:
  *   - 0b00nnnnnn: Output nnnnnn on data pins
- *   - 0b01xxxxxx: Read pin 13 and 15 and return a byte formatted like the
+ *   - 0b01000000: Read pin 13 and 15 and return a byte formatted like the
  *                 status register of a parallel port.
- *   - 0b80xxxxxn 0x12 0x34: Read 0xn1234 from to the chip starting from
- *                 address 0, data is sent back byte by byte on the serial port
+ *   - 0x41 followed by frames 0bxxxxxxAA 0xAA 0xAA 0xNN + 0xNN bytes: Write
+ *                 0xNN bytes (at most 56, or what hello reported) to the
+ *                 chip starting from address
+ *                 0xAAAAA. The Arduino first answers with the number of
+ *                 frames it can buffer (credits), then gives a credit back
+ *                 (the size of the frame) every time a frame has been
+ *                 programmed. A frame of size 0 ends the list. If writing
+ *                 fails, 0xff followed by the failing address on 24 bits is
+ *                 sent instead of the credit, the next frames are ignored and
+ *                 the frame of size 0 is still acknowledged.
+ *   - 0x42: Measure how long the chip takes to ACK pentads by reading its
+ *                 first bytes, answers with a status byte followed by the
+ *                 median, 99th percentile and max latencies and the chosen
+ *                 spin time, all of them in microseconds on 16 bits.
+ *   - 0x43 0xSS 0xSS: Spin for 0xSSSS microseconds waiting for ACKs before
+ *                 servicing the serial port.
+ *   - 0x44: Erase the chip and wait for it to be done, answers with a
+ *                 status byte (0 if erased, 1 on timeout) followed by the
+ *                 time it took in milliseconds on 16 bits.
+ *   - 0x45 0bxxxxxxxn 0x12 0x34 0xBB: Read 0xn1234 bytes from the chip (from
+ *                 the address the client put it in read mode at) and
+ *                 answer with a status byte and the CRC32 (on 32 bits) of
+ *                 every 0xBB * 256 bytes, or of the whole range if 0xBB is 0.
+ *   - 0x46 0xEE: Stop waiting for the chip to ACK pentads if 0xEE is 1 and
+ *                 wait for the handshake spin time after each strobe edge
+ *                 instead, go back to safe mode if 0.
+ *   - 0x47 0xBB 0xBB 0xBB 0xBB: Switch to the baud rate 0xBBBBBBBB, answers
+ *                 with 0 if it can't be generated accurately enough, or 1
+ *                 before switching. The client then sends BAUD_PATTERN at
+ *                 the new rate and gets it back if it was received intact,
+ *                 and commits the switch with 0x47 (answered with 1).
+ *                 Otherwise, or if that doesn't happen in time, the Arduino
+ *                 goes back to the previous rate once the link was quiet for
+ *                 BAUD_SETTLE_MS.
+ *   - 0x48 0xMM 0xNN 0xNN: Loopback test of the serial link over 0xNNNN
+ *                 bytes, with mode 0xMM. 0: echo every byte received, 1:
+ *                 only receive them, 2: send 0xNNNN bytes. Answers with the
+ *                 micros() of the first and of the last byte received (or
+ *                 of the start and end of sending) on 32 bits each, they
+ *                 are equal if the payload stopped for Serial's timeout.
+ *   - 0x49 0xKK + 0xKK bytes: Send 0xKK pentads (at most 62) to the chip,
+ *                 each one waiting for its ACKs like outb and inb would
+ *                 from the client, answers with a status byte once done
+ *                 (0 if they were all ACKed, otherwise the mask of the
+ *                 modules that missed one and didn't get the next ones).
+ *                 Longer frames are skipped without touching the chip and
+ *                 answered with 1.
+ *   - 0x4a 0xMM: Send the next commands to the modules of mask 0xMM,
+ *                 answers with the ones that exist (0 and nothing changes if
+ *                 none of them do). Pentads, extents and erases go to all of
+ *                 them at once, what reads the chip only to the first one.
+ *   - 0x4b: Answers with the mask of the modules whose writes failed since
+ *                 0x4a, followed by the failing address of each of them on
+ *                 24 bits.
+ *   - 0x4c followed by frames like 0x41: Compare the chip (from the address
+ *                 the client put it in read mode at) with the 0xNN bytes of
+ *                 each frame, credits come and go the same way. Ranges that
+ *                 differ are sent along with them as 0xfe, their start and
+ *                 size on 24 bits each and 1 if some of their bits have to
+ *                 be set back to 1 (0 otherwise). If reading fails, 0xff and
+ *                 the address are sent instead and the next frames ignored.
+ *                 The frame of size 0 is acknowledged followed by the number
+ *                 of bytes that differ on 24 bits.
+ *   - 0x7f: Hello, answers with 0x56 followed by the size of the fields
+ *                 below, the protocol version, the accelerated functions
+ *                 supported (bit 0: 0x41, bit 1: 0x42/0x43, bit 2: 0x44,
+ *                 bit 3: 0x45, bit 4: read stream abort, bit 5: 0x46,
+ *                 bit 6: 0x47, bit 7: 0x48, bit 8: 0x49, bit 9: 0x4a/0x4b,
+ *                 bit 10: 0x4c) on 16 bits, the baud rate on 32 bits (0 over
+ *                 native USB), the size of the serial buffer on 16 bits, the
+ *                 number of frames 0x41 buffers, their maximum size and the
+ *                 number of modules.
+ *                 Older versions of this sketch answer with a status byte,
+ *                 new fields must only be appended.
+ *   - 0b80xxxxxn 0x12 0x34: Read 0xn1234 bytes from the chip starting from
+ *                 the address the client put it in read mode at (0x11
+ *                 followed by 4 zero pentads, then as many reads as the
+ *                 address), data is sent back byte by byte on the serial port
+ *                 until 0x10 is received. Sent after the end of the stream,
+ *                 0x10 is an outb leaving the data pins as they already are.
+ *                 If reading fails, the stream stops there and the client
+ *                 times out on the silence while commands are served again.
  *   - 0bC0xxxxxn 0xAB 0xCD: Write 0xnABCD bytes to the chip starting from
  *                 address 0, data is received in chunks on the serial port
  *
@@ -33,14 +115,138 @@ static const uint8_t PIN_ERR = 9;	/* D9 */
 #define BAUD_RATE 1000000
 #endif
 
+/*
+ * Boards with native USB (ATmega32U4, RP2040) are reached through USB CDC
+ * instead of a UART behind a USB to serial adapter: there is no baud rate to
+ * negotiate and the host can send larger frames at once.
+ */
+#ifndef NATIVE_USB
+#if defined(USBCON) || defined(ARDUINO_ARCH_RP2040)
+#define NATIVE_USB 1
+#else
+#define NATIVE_USB 0
+#endif
+#endif
+
+/* What the client can send without waiting for the sketch to read it */
+#ifndef RX_BUFFER_SIZE
+#if defined(ARDUINO_ARCH_RP2040)
+#define RX_BUFFER_SIZE 256	/* CDC FIFO of TinyUSB */
+#elif NATIVE_USB
+#define RX_BUFFER_SIZE 64	/* USB endpoint */
+#elif defined(SERIAL_RX_BUFFER_SIZE)
+#define RX_BUFFER_SIZE SERIAL_RX_BUFFER_SIZE
+#else
+#define RX_BUFFER_SIZE 64
+#endif
+#endif
+
+static const uint8_t PROTOCOL_VERSION = 1;
+static const uint8_t BRIDGE_MAGIC = 0x56;
+static const uint16_t CAP_WRITE_EXTENTS = 0x0001;
+static const uint16_t CAP_CALIBRATE = 0x0002;
+static const uint16_t CAP_ERASE = 0x0004;
+static const uint16_t CAP_CHECKSUM = 0x0008;
+static const uint16_t CAP_STREAM_ABORT = 0x0010;
+static const uint16_t CAP_FAST = 0x0020;
+static const uint16_t CAP_BAUD = 0x0040;
+static const uint16_t CAP_LOOPBACK = 0x0080;
+static const uint16_t CAP_PENTADS = 0x0100;
+static const uint16_t CAP_MODULES = 0x0200;
+static const uint16_t CAP_DIFF = 0x0400;
+static const uint8_t LOOPBACK_ECHO = 0;
+static const uint8_t LOOPBACK_SOURCE = 2;
+static const uint8_t STREAM_ABORT = 0x10;
+static const uint8_t STREAM_END = 0x00; /* Pentad sent once a stream is over */
+
+/* Current rate, the link always starts at BAUD_RATE */
+static uint32_t baud_rate = BAUD_RATE;
+static const unsigned long BAUD_SETTLE_MS = 200;
+/* Same as in arduino_serial.c, bit patterns that break at the wrong rate */
+static const uint8_t BAUD_PATTERN[] = {
+	0x00, 0xff, 0x55, 0xaa, 0x0f, 0xf0, 0x33, 0xcc,
+	0x01, 0x80, 0xfe, 0x7f, 0x5a, 0xa5, 0x3c, 0xc3,
+};
+
+/*
+ * Read pins 13 and 15 straight from the PINB register (D8 and D9 are bits 0
+ * and 1 of port B) and poll the ACK with a microsecond resolution instead of
+ * going through digitalRead() and sleeping 1ms. On the RP2040, GP2 to GP9 are
+ * accessed through the SIO registers the same way. Build with FAST_GPIO=0 to
+ * use the slower portable version, the only one for the ATmega32U4 whose D2
+ * to D9 are spread over 4 ports.
+ */
+#ifndef FAST_GPIO
+#define FAST_GPIO 1
+#endif
+
+#if FAST_GPIO && defined(USBCON)
+#error "The pins of the ATmega32U4 don't map to a single port, build with FAST_GPIO=0"
+#endif
+
+#if FAST_GPIO && defined(ARDUINO_ARCH_RP2040)
+#include <hardware/gpio.h>
+#endif
+
+/*
+ * The Mega has enough ports for a module on each of A, C, L and K: data on
+ * bits 0 to 5, SELECT on bit 6 and ERROR on bit 7. The handshakes of all the
+ * modules overlap, each one moves on to its next pentad as soon as its own
+ * chip ACKed, so they are all programmed in about the time of the slowest.
+ */
+#ifndef MODULES
+#if defined(__AVR_ATmega2560__)
+#define MODULES 4
+#else
+#define MODULES 1
+#endif
+#endif
+
+#if MODULES > 1 && !defined(__AVR_ATmega2560__) && !defined(BRIDGE_EMU)
+#error "Several modules need the ports of an ATmega2560"
+#endif
+#if MODULES > 4
+#error "The ATmega2560 only has room for 4 modules"
+#endif
+#if MODULES > 1 && !FAST_GPIO
+#error "Several modules are only driven through the port registers"
+#endif
+
+static uint8_t active = 1; /* Modules the commands go to */
+static uint8_t modules_failed; /* Whose writes failed since select_modules() */
+static uint32_t module_failed_at[MODULES];
+
+static const uint8_t PIN_DATA = 2; /* D2 to D7 */
+static const uint8_t PIN_STROBE = 6; /* Data bit 4 */
+
 void setup()
 {
+#if MODULES > 1
+	/* Data pins as outputs, pull-ups on SELECT and ERROR */
+	DDRA = 0x3f;
+	DDRC = 0x3f;
+	DDRL = 0x3f;
+	DDRK = 0x3f;
+	PORTA = 0xc0;
+	PORTC = 0xc0;
+	PORTL = 0xc0;
+	PORTK = 0xc0;
+#elif FAST_GPIO && defined(ARDUINO_ARCH_RP2040)
+	gpio_init_mask(0xfc);
+	gpio_set_dir_out_masked(0xfc);
+#elif FAST_GPIO
 	DDRD = DDRD | B11111100;
+#else
+	for (uint8_t pin = PIN_DATA; pin < PIN_DATA + 6; ++pin)
+		pinMode(pin, OUTPUT);
+#endif
+#if MODULES == 1
 	pinMode(PIN_ERR, INPUT_PULLUP);
 	pinMode(PIN_SEL, INPUT_PULLUP);
+#endif
 
 	Serial.setTimeout(2000);
-	Serial.begin(BAUD_RATE);
+	Serial.begin(baud_rate);
 }
 
 static inline unsigned char serial_read_one_byte()
@@ -53,36 +259,341 @@ static inline unsigned char serial_read_one_byte()
 	return (unsigned char) b;
 }
 
+/*
+ * Frames of the extent stream are buffered in a ring of slots so the next ones
+ * are received while the current one is programmed. The client never has more
+ * frames in flight than there are free slots, window_pump() only has to be
+ * called often enough for the 64 bytes serial buffer not to overflow: outp()
+ * and fan_out() call it for every strobe edge, a byte takes 9 pentads.
+ */
+static const uint8_t FRAME_HEADER_SZ = 4;
+/* Leaves room for the header of the next frame, sizes fit on a byte */
+#if RX_BUFFER_SIZE >= 256
+static const uint8_t FRAME_MAX_DATA_SZ = 248;
+#define WINDOW_SLOTS 16
+#else
+static const uint8_t FRAME_MAX_DATA_SZ = RX_BUFFER_SIZE - 2 * FRAME_HEADER_SZ;
+#define WINDOW_SLOTS 8
+#endif
+
+static uint8_t window[WINDOW_SLOTS][FRAME_HEADER_SZ + FRAME_MAX_DATA_SZ];
+static uint8_t window_head;	/* Slot being programmed */
+static uint8_t window_count;	/* Complete frames in the ring */
+static uint8_t window_pos;	/* Bytes received of the next frame */
+static bool window_open;
+static bool window_error;
+
+static void window_pump()
+{
+	if (!window_open)
+		return;
+
+	while (window_count < WINDOW_SLOTS && Serial.available()) {
+		uint8_t *frame = window[(window_head + window_count)
+					% WINDOW_SLOTS];
+
+		frame[window_pos++] = Serial.read();
+		if (window_pos < FRAME_HEADER_SZ)
+			continue;
+		if (frame[3] > FRAME_MAX_DATA_SZ) {
+			window_error = true;
+			window_open = false;
+			return;
+		}
+		if (window_pos == FRAME_HEADER_SZ + frame[3]) {
+			window_pos = 0;
+			++window_count;
+		}
+	}
+}
+
+/* Starts receiving frames and advertises the credits */
+static void window_start()
+{
+	window_head = window_count = window_pos = 0;
+	window_error = false;
+	window_open = true;
+	Serial.write(WINDOW_SLOTS);
+}
+
+/* Next complete frame, NULL if the client stopped sending them */
+static uint8_t *window_wait()
+{
+	static const unsigned long TIMEOUT_MS = 2000;
+	unsigned long start = millis();
+
+	while (window_count == 0) {
+		window_pump();
+		if (window_error || millis() - start > TIMEOUT_MS) {
+			window_open = false;
+			return NULL;
+		}
+	}
+	return window[window_head];
+}
+
+/* Done with the frame window_wait() returned, its slot can be reused */
+static void window_release()
+{
+	window_head = (window_head + 1) % WINDOW_SLOTS;
+	--window_count;
+}
+
+static uint32_t frame_address(const uint8_t *frame)
+{
+	return (uint32_t) (frame[0] & 0x3) << 16 | (uint32_t) frame[1] << 8
+		| frame[2];
+}
+
+/* Busy wait while still receiving frames */
+static void idle(unsigned long us)
+{
+	unsigned long start = micros();
+
+	while (micros() - start < us)
+		window_pump();
+}
+
+#if MODULES > 1
+static uint8_t module; /* First active one, the chip being read */
+
+static void select_module(uint8_t m)
+{
+	module = m;
+}
+
+static void port_outb(uint8_t m, uint8_t data)
+{
+	/* Keeps the pull-ups of SELECT and ERROR */
+	data = (data & 0x3f) | 0xc0;
+	switch (m) {
+	case 0:
+		PORTA = data;
+		break;
+	case 1:
+		PORTC = data;
+		break;
+	case 2:
+		PORTL = data;
+		break;
+	default:
+		PORTK = data;
+		break;
+	}
+}
+
+static uint8_t port_status(uint8_t m)
+{
+	switch (m) {
+	case 0:
+		return PINA;
+	case 1:
+		return PINC;
+	case 2:
+		return PINL;
+	default:
+		return PINK;
+	}
+}
+
+static inline bool port_err_high(uint8_t m)
+{
+	return port_status(m) & _BV(7);
+}
+
+static void outb(uint8_t data)
+{
+	port_outb(module, data);
+}
+
+static inline bool sel_high()
+{
+	return port_status(module) & _BV(6);
+}
+
+static inline bool err_high()
+{
+	return port_err_high(module);
+}
+
+/* Raw outb from the client, all the modules follow the same handshake */
+static void outb_all(uint8_t data)
+{
+	for (uint8_t m = 0; m < MODULES; ++m) {
+		if (active & _BV(m))
+			port_outb(m, data);
+	}
+}
+
+/*
+ * ERROR as the client sees it only changes once all the active modules agree,
+ * so that it waits for the slowest one
+ */
+static bool err_agreed()
+{
+	static bool agreed;
+	uint8_t high = 0;
+
+	for (uint8_t m = 0; m < MODULES; ++m) {
+		if (active & _BV(m) && port_err_high(m))
+			high |= _BV(m);
+	}
+	if (high == active)
+		agreed = true;
+	else if (high == 0)
+		agreed = false;
+	return agreed;
+}
+#elif FAST_GPIO && defined(ARDUINO_ARCH_RP2040)
+static void outb(uint8_t data)
+{
+	gpio_put_masked(0xfc, (uint32_t) data << 2);
+}
+
+static inline bool sel_high()
+{
+	return gpio_get(PIN_SEL);
+}
+
+static inline bool err_high()
+{
+	return gpio_get(PIN_ERR);
+}
+#elif FAST_GPIO
 static void outb(uint8_t data)
 {
 	PORTD = (((uint8_t) data) << 2) | (PORTD & 0x3);
 }
 
+static inline bool sel_high()
+{
+	return PINB & _BV(0);
+}
+
+static inline bool err_high()
+{
+	return PINB & _BV(1);
+}
+#else
+/*
+ * The pins change one after the other, the strobe goes last so that the chip
+ * only ever sees its edges with the data already set
+ */
+static void outb(uint8_t data)
+{
+	const uint8_t strobe = PIN_STROBE - PIN_DATA;
+
+	for (uint8_t bit = 0; bit < 6; ++bit) {
+		if (bit != strobe)
+			digitalWrite(PIN_DATA + bit, (data >> bit) & 1);
+	}
+	digitalWrite(PIN_STROBE, (data >> strobe) & 1);
+}
+
+static inline bool sel_high()
+{
+	return digitalRead(PIN_SEL) == HIGH;
+}
+
+static inline bool err_high()
+{
+	return digitalRead(PIN_ERR) == HIGH;
+}
+#endif
+
+#if MODULES == 1
+static inline void select_module(uint8_t)
+{
+}
+
+static void outb_all(uint8_t data)
+{
+	outb(data);
+}
+
+static inline bool err_agreed()
+{
+	return err_high();
+}
+#endif
+
 static void inb()
 {
 	uint8_t r = 0;
 
-	if (digitalRead(PIN_SEL) == HIGH)
+	if (sel_high())
 		r |= 0x10; /* 0001 0000 = PIN 13 */
-	if (digitalRead(PIN_ERR) == HIGH)
+	if (err_agreed())
 		r |= 0x08; /* 0000 1000 = PIN 15 */
 
 	Serial.write(r);
 }
 
+/*
+ * ACK latencies are only recorded while calibrating, in buckets matching the
+ * 4us resolution of micros() on a 16MHz board
+ */
+#define ACK_BUCKETS 32
+static const uint8_t ACK_BUCKET_US = 4;
+static const uint16_t MAX_SPIN_US = 400;
+
+static uint16_t *ack_histogram;
+static uint16_t ack_max_us;
+static uint16_t handshake_spin_us; /* Don't service serial before that */
+static bool fast_mode; /* Pace pentads with handshake_spin_us, no ACKs */
+
+static inline void ack_record(unsigned long us)
+{
+	if (!ack_histogram)
+		return;
+	if (us > ack_max_us)
+		ack_max_us = us;
+	us /= ACK_BUCKET_US;
+	++ack_histogram[us < ACK_BUCKETS ? us : ACK_BUCKETS - 1];
+}
+
+#if FAST_GPIO
+static int safe_mode_check(bool check_high)
+{
+	static const uint8_t SPIN_TRIES = 16;
+	static const unsigned long TIMEOUT_US = 4000;
+	unsigned long start, elapsed;
+
+	/* Chip ACKs by setting pin 15 to high, it usually does so right away */
+	for (uint8_t tries = 0; tries < SPIN_TRIES; ++tries) {
+		if (err_high() == check_high) {
+			ack_record(0);
+			return 0;
+		}
+	}
+	start = micros();
+	do {
+		elapsed = micros() - start;
+		if (err_high() == check_high) {
+			ack_record(elapsed);
+			return 0;
+		}
+		if (elapsed >= handshake_spin_us)
+			window_pump();
+	} while (elapsed < TIMEOUT_US);
+	return 1;
+}
+#else
 static int safe_mode_check(bool check_high)
 {
 	static const uint8_t MAX_TRIES = 4;
 
 	/* Chip ACKs by setting pin 15 to high */
 	for (uint8_t tries = 0; tries < MAX_TRIES; ++tries) {
-		if ((check_high && digitalRead(PIN_ERR) != LOW)
-		    || (!check_high && digitalRead(PIN_ERR) != HIGH))
+		if (err_high() == check_high) {
+			ack_record(tries * 1000);
 			return 0;
-		delay(1); /* 1ms */
+		}
+		idle(1000); /* 1ms */
 	}
 	return 1;
 }
+#endif
 
 /* Writes 5 bits (a pentad) encoded on 6 wires and check for errors */
 static int outp(uint8_t data)
@@ -92,15 +603,238 @@ static int outp(uint8_t data)
 	if (data & 0x10)
 		formatted_data = formatted_data | 0x20;
 
+	if (fast_mode) {
+		const uint16_t pace_us = handshake_spin_us > ACK_BUCKET_US
+			? handshake_spin_us : ACK_BUCKET_US;
+
+		outb(formatted_data);
+		idle(pace_us);
+		outb(formatted_data | 0x10);
+		idle(pace_us);
+		return 0;
+	}
+	/*
+	 * A healthy chip ACKs within the spin time and safe_mode_check() never
+	 * gets to pump, frames are received while the chip takes the edge
+	 */
 	outb(formatted_data);
+	window_pump();
 	if (safe_mode_check(true))
 		return 1;
 	outb(formatted_data | 0x10);
+	window_pump();
 	if (safe_mode_check(false))
 		return 1;
 	return 0;
 }
 
+/* The module that reads are answered from */
+static uint8_t first_active()
+{
+	uint8_t m = 0;
+
+	while (!(active & 1 << m))
+		++m;
+	return m;
+}
+
+#if MODULES > 1
+/*
+ * Every active module runs the same sequence of pentads in its own lane, a
+ * lane outputs its next strobe edge as soon as its chip ACKed the previous
+ * one instead of waiting for the others
+ */
+struct lane {
+	uint16_t step;		/* Pentad of the sequence being sent */
+	uint8_t pins;		/* Data pins of the last strobe edge */
+	unsigned long since;	/* When it was output */
+};
+
+static struct lane lanes[MODULES];
+
+/* The sequence, a list of pentads or the bytes of a frame to program */
+static const uint8_t *fan_data;
+static uint16_t fan_count;
+static bool fan_frame;
+static uint32_t fan_address;
+
+static const uint8_t WRITE_PENTADS = 9;
+
+/* Pentad i of a byte write, in the order write_byte() sends them */
+static uint8_t write_pentad(uint32_t address, uint8_t data, uint8_t i)
+{
+	const uint8_t CMD_WRITE_BYTE = 0x05;
+
+	switch (i) {
+	case 0:
+		return CMD_WRITE_BYTE;
+	case 1:
+		return ((data >> 3) & 0x1c) | address >> 15;
+	case 2:
+		return address >> 10;
+	case 3:
+		return address >> 5;
+	case 4:
+		return address;
+	default:
+		return data;
+	}
+}
+
+/* Pentad at step of the sequence, blank bytes of frames are skipped */
+static int16_t fan_pentad(uint16_t *step)
+{
+	if (!fan_frame)
+		return *step < fan_count ? fan_data[*step] : -1;
+	for (;;) {
+		uint16_t i = *step / WRITE_PENTADS;
+
+		if (i >= fan_count)
+			return -1;
+		if (fan_data[i] != 0xff)
+			return write_pentad(fan_address + i, fan_data[i],
+					    *step % WRITE_PENTADS);
+		*step = (i + 1) * WRITE_PENTADS;
+	}
+}
+
+/* Outputs the first edge of the next pentad of lane m, false once done */
+static bool lane_start(uint8_t m)
+{
+	struct lane *l = &lanes[m];
+	int16_t data = fan_pentad(&l->step);
+
+	if (data < 0)
+		return false;
+	l->pins = data & 0xf;
+	if (data & 0x10)
+		l->pins |= 0x20;
+	port_outb(m, l->pins);
+	l->since = micros();
+	return true;
+}
+
+/*
+ * Runs the sequence on the modules of mask and returns those that missed an
+ * ACK. Like in write_byte(), the ACKs of the data of a byte don't matter.
+ */
+static uint8_t fan_out(uint8_t mask)
+{
+	static const unsigned long TIMEOUT_US = 4000;
+	const uint16_t pace_us = handshake_spin_us > ACK_BUCKET_US
+		? handshake_spin_us : ACK_BUCKET_US;
+	uint8_t busy = 0, failed = 0;
+
+	for (uint8_t m = 0; m < MODULES; ++m) {
+		lanes[m].step = 0;
+		if (mask & _BV(m) && lane_start(m))
+			busy |= _BV(m);
+	}
+	while (busy) {
+		for (uint8_t m = 0; m < MODULES; ++m) {
+			struct lane *l = &lanes[m];
+			bool strobe = l->pins & 0x10;
+			unsigned long elapsed;
+			bool done;
+
+			if (!(busy & _BV(m)))
+				continue;
+			elapsed = micros() - l->since;
+			if (fast_mode)
+				done = elapsed >= pace_us;
+			else
+				done = port_err_high(m) != strobe;
+
+			if (!done) {
+				if (fast_mode || elapsed < TIMEOUT_US)
+					continue;
+				if (!fan_frame || l->step % WRITE_PENTADS < 5) {
+					if (fan_frame)
+						module_failed_at[m] = fan_address
+							+ l->step / WRITE_PENTADS;
+					failed |= _BV(m);
+					busy &= ~_BV(m);
+					continue;
+				}
+			} else if (!strobe) {
+				l->pins |= 0x10;
+				port_outb(m, l->pins);
+				l->since = micros();
+				continue;
+			}
+			++l->step;
+			if (!lane_start(m))
+				busy &= ~_BV(m);
+		}
+		window_pump();
+	}
+	return failed;
+}
+
+/* Sends count pentads to all the active modules, returns the failed ones */
+static uint8_t outp_all(const uint8_t *data, uint8_t count)
+{
+	fan_data = data;
+	fan_count = count;
+	fan_frame = false;
+	return fan_out(active);
+}
+
+/* Programs a frame into the modules of mask, returns those that failed */
+static uint8_t program_frame(uint8_t mask, uint32_t address,
+			     const uint8_t *data, uint8_t size)
+{
+	fan_data = data;
+	fan_count = size;
+	fan_frame = true;
+	fan_address = address;
+	return fan_out(mask);
+}
+#else
+static uint8_t outp_all(const uint8_t *data, uint8_t count)
+{
+	for (uint8_t i = 0; i < count; ++i) {
+		if (outp(data[i]))
+			return 1;
+	}
+	return 0;
+}
+#endif
+
+/*
+ * Runs a whole sequence of pentads (chip init, read mode, reset...) in a
+ * single message, instead of a round trip for every ACK the client checks
+ */
+static void pentads()
+{
+	static const uint8_t MAX_PENTADS = 62;
+	uint8_t data[MAX_PENTADS];
+	uint8_t count = serial_read_one_byte();
+	uint8_t r = 0;
+
+	if (count > MAX_PENTADS) {
+		/*
+		 * Not from a client of this version, don't touch the chip
+		 * and don't run the payload as commands either
+		 */
+		for (uint8_t left = count; left; ) {
+			uint8_t n = left < MAX_PENTADS ? left : MAX_PENTADS;
+
+			if (Serial.readBytes(data, n) != n)
+				break;
+			left -= n;
+		}
+		Serial.write(1);
+		return;
+	}
+	if (Serial.readBytes(data, count) != count) {
+		Serial.write(1);
+		return;
+	}
+	r = outp_all(data, count);
+	Serial.write(r);
+}
+
 static uint32_t read_size(uint8_t first)
 {
 	uint8_t size[2] = {0};
@@ -110,28 +844,212 @@ static uint32_t read_size(uint8_t first)
 	return (uint32_t) first << 16 | (uint32_t) size[0] << 8 | size[1];
 }
 
+/* Sets the chip in read mode from address 0 */
+static int init_read_mode()
+{
+	const uint8_t CMD_READ_INIT = 0x11;
+
+	if (outp(CMD_READ_INIT))
+		return 1;
+	for (uint8_t i = 0; i < 4; ++i) {
+		if (outp(0x00))
+			return 1;
+	}
+	return 0;
+}
+
+/* Reads next byte in order from the chip, least significant bit first */
+static int read_byte(uint8_t *out)
+{
+	const uint8_t CMD_READ = 0x0d;
+	uint8_t data = 0;
+
+	if (outp(CMD_READ))
+		return 1;
+	for (uint8_t i = 0; i < 8; ++i) {
+		data = data >> 1;
+		if (sel_high())
+			data |= 0x80;
+		/* Acknowledge we've read bit number i */
+		if (outp(i))
+			return 1;
+	}
+	*out = data;
+	return 0;
+}
+
 static int read_byte_stream(uint8_t first)
 {
 	uint8_t data = 0;
-	const uint8_t CMD_READ = 0x0d;
 	uint32_t total = read_size(first);
 
 	for (uint32_t b = 0; b < total; ++b) {
-		if (outp(CMD_READ))
+		/* The client found what it was looking for, stop right away */
+		if (Serial.available() && Serial.read() == STREAM_ABORT)
+			return 0;
+		if (read_byte(&data))
 			return 1;
-		for (uint8_t i = 0; i < 8; ++i) {
-			data = data >> 1;
-			if (digitalRead(PIN_SEL) == HIGH)
-				data |= 0x80;
-			/* Acknowledge we've read bit number i */
-			if (outp(i))
-				return 1;
-		}
 		Serial.write(data);
 	}
 	return 0;
 }
 
+static void write_u16(uint16_t v)
+{
+	Serial.write(v >> 8);
+	Serial.write(v & 0xff);
+}
+
+static void write_u24(uint32_t v)
+{
+	Serial.write((v >> 16) & 0xff);
+	write_u16(v & 0xffff);
+}
+
+static void write_u32(uint32_t v)
+{
+	write_u16(v >> 16);
+	write_u16(v & 0xffff);
+}
+
+static uint32_t read_u24()
+{
+	uint8_t b[3] = {0};
+
+	Serial.readBytes(b, 3);
+	return (uint32_t) b[0] << 16 | (uint32_t) b[1] << 8 | b[2];
+}
+
+/* Bitwise CRC32, reading a byte from the chip takes a lot longer anyway */
+static uint32_t crc32_update(uint32_t crc, uint8_t data)
+{
+	crc ^= data;
+	for (uint8_t i = 0; i < 8; ++i)
+		crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+	return crc;
+}
+
+static void checksum_stream()
+{
+	uint32_t total = read_u24();
+	uint32_t block_sz = (uint32_t) serial_read_one_byte() << 8;
+	uint32_t crc = 0xffffffff;
+
+	if (block_sz == 0)
+		block_sz = total;
+	for (uint32_t b = 0; b < total; ++b) {
+		uint8_t data;
+
+		if (read_byte(&data)) {
+			Serial.write(1);
+			write_u32(0);
+			return;
+		}
+		crc = crc32_update(crc, data);
+		if ((b + 1) % block_sz == 0 || b + 1 == total) {
+			Serial.write(0);
+			write_u32(~crc);
+			crc = 0xffffffff;
+		}
+	}
+}
+
+/*
+ * Computes the ACK latency distribution over the first bytes of the chip, of
+ * each active module in turn
+ */
+static void calibrate_handshake()
+{
+	static const uint8_t CALIBRATION_BYTES = 32;
+	uint16_t histogram[ACK_BUCKETS] = {0};
+	uint32_t total = 0, seen = 0;
+	uint16_t p50 = 0, p99 = 0;
+	uint8_t status = 0, data;
+
+	ack_max_us = 0;
+	ack_histogram = histogram;
+	for (uint8_t m = 0; m < MODULES && status == 0; ++m) {
+		if (!(active & 1 << m))
+			continue;
+		select_module(m);
+		status = init_read_mode();
+		for (uint8_t i = 0; i < CALIBRATION_BYTES && status == 0; ++i)
+			status = read_byte(&data);
+	}
+	select_module(first_active());
+	ack_histogram = NULL;
+
+	for (uint8_t b = 0; b < ACK_BUCKETS; ++b)
+		total += histogram[b];
+	for (uint8_t b = 0; b < ACK_BUCKETS; ++b) {
+		uint16_t upper = (b + 1) * ACK_BUCKET_US;
+
+		if (b == ACK_BUCKETS - 1 || upper > ack_max_us)
+			upper = ack_max_us;
+
+		seen += histogram[b];
+		if (!p50 && seen * 2 >= total)
+			p50 = upper;
+		if (!p99 && seen * 100 >= total * 99)
+			p99 = upper;
+	}
+	if (status == 0)
+		handshake_spin_us = p99 * 2 < MAX_SPIN_US ? p99 * 2 : MAX_SPIN_US;
+
+	Serial.write(status);
+	write_u16(p50);
+	write_u16(p99);
+	write_u16(ack_max_us);
+	write_u16(handshake_spin_us);
+}
+
+/*
+ * The chip is done erasing once two reads of its first byte match and that
+ * byte reads as blank, failures are ignored on purpose just like the original
+ * loader does. All the modules erase at once, then each of them is polled.
+ */
+static void erase_chip()
+{
+	static const unsigned long TIMEOUT_MS = 30000;
+	static const uint8_t CMD_ERASE[13] = {
+		0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03,
+		0x03, 0x03, 0x03, 0x03, 0x03, 0x03,
+	};
+	unsigned long start = millis();
+	uint8_t status = 0, c1, c2 = 0;
+
+	outp_all(CMD_ERASE, sizeof(CMD_ERASE));
+
+	for (uint8_t m = 0; m < MODULES && status == 0; ++m) {
+		if (!(active & 1 << m))
+			continue;
+		select_module(m);
+		init_read_mode();
+		read_byte(&c2);
+		do {
+			c1 = c2;
+			init_read_mode();
+			read_byte(&c2);
+			if (millis() - start > TIMEOUT_MS)
+				status = 1;
+		} while ((c1 != c2 || c2 != 0xff) && status == 0);
+	}
+	select_module(first_active());
+
+	Serial.write(status);
+	write_u16(millis() - start);
+}
+
+static void set_handshake_spin()
+{
+	uint8_t spin[2] = {0};
+
+	Serial.readBytes(spin, 2);
+	handshake_spin_us = (uint16_t) spin[0] << 8 | spin[1];
+	if (handshake_spin_us > MAX_SPIN_US)
+		handshake_spin_us = MAX_SPIN_US;
+}
+
 static int write_byte(uint32_t address, uint8_t data)
 {
 	const uint8_t CMD_WRITE_BYTE = 0x05;
@@ -161,6 +1079,46 @@ static int write_byte(uint32_t address, uint8_t data)
 	return 0;
 }
 
+#if MODULES == 1
+static uint8_t program_frame(uint8_t, uint32_t address, const uint8_t *data,
+			     uint8_t size)
+{
+	for (uint8_t i = 0; i < size; ++i) {
+		if (write_byte(address + i, data[i])) {
+			module_failed_at[0] = address + i;
+			return 1;
+		}
+	}
+	return 0;
+}
+#endif
+
+/* Where the first of the modules that failed stopped */
+static uint32_t lowest_failed_at()
+{
+	uint32_t lowest = 0xffffff;
+
+	for (uint8_t m = 0; m < MODULES; ++m) {
+		if (modules_failed & 1 << m && module_failed_at[m] < lowest)
+			lowest = module_failed_at[m];
+	}
+	return lowest;
+}
+
+/* Throws away what the client sent until it is done sending */
+static void discard_input()
+{
+	static const unsigned long QUIET_MS = 100;
+	unsigned long start = millis();
+
+	while (millis() - start < QUIET_MS) {
+		if (Serial.available()) {
+			Serial.read();
+			start = millis();
+		}
+	}
+}
+
 static int write_byte_stream(uint8_t first)
 {
 	uint8_t data_buffer[60];
@@ -176,31 +1134,363 @@ static int write_byte_stream(uint8_t first)
 			if (r < 60)
 				return 1;
 		}
-		if (write_byte(i, data_buffer[i % 60]))
+		if (write_byte(i, data_buffer[i % 60])) {
+			/*
+			 * The client times out waiting for the next credit,
+			 * don't take the rest of the stream as commands
+			 */
+			discard_input();
 			return 1;
+		}
 	}
 	return 0;
 }
 
+/*
+ * Only the non blank parts of the image are sent by the client, each of them
+ * prefixed by its address so there is no need to walk over 0xff bytes. A
+ * module that fails stops there while the others go on, the client only hears
+ * about it from 0x4b unless all of them failed.
+ */
+static int write_extents()
+{
+	static const uint8_t WRITE_FAILED = 0xff;
+	uint8_t writing = active;
+
+	window_start();
+	for (;;) {
+		uint8_t *frame = window_wait();
+		uint8_t size;
+
+		if (!frame)
+			return 1;
+		size = frame[3];
+		if (writing) {
+			uint8_t failed = program_frame(writing,
+						       frame_address(frame),
+						       &frame[FRAME_HEADER_SZ],
+						       size);
+
+			writing &= ~failed;
+			modules_failed |= failed;
+			if (!writing) {
+				/* Let the client know where to resume from */
+				Serial.write(WRITE_FAILED);
+				write_u24(lowest_failed_at());
+			}
+		}
+
+		window_release();
+		if (size == 0) {
+			Serial.write(size);
+			window_open = false;
+			return !writing;
+		}
+		if (writing)
+			Serial.write(size); /* Give the credit back */
+	}
+}
+
+/* A range of the chip that differs, to the client of diff_stream() */
+static void diff_range(uint32_t start, uint32_t end, bool erase)
+{
+	static const uint8_t DIFF_RANGE = 0xfe;
+
+	Serial.write(DIFF_RANGE);
+	write_u24(start);
+	write_u24(end - start);
+	Serial.write(erase ? 1 : 0);
+}
+
+/*
+ * The client streams what the chip should hold in frames like the extents,
+ * starting from the address it put the chip in read mode at. Each byte is
+ * compared as it is read and only the ranges that differ are sent back, with
+ * the credits. Differences less than DIFF_GAP bytes apart share a range so
+ * the reply never gets larger than the content of the chip.
+ */
+static void diff_stream()
+{
+	static const uint8_t READ_FAILED = 0xff;
+	static const uint8_t DIFF_GAP = 8;
+	uint32_t start = 0, end = 0, diffs = 0;
+	bool open = false, erase = false, failed = false;
+
+	window_start();
+	for (;;) {
+		uint8_t *frame = window_wait();
+		uint32_t address;
+		uint8_t size;
+
+		if (!frame)
+			return;
+		size = frame[3];
+		address = frame_address(frame);
+		for (uint8_t i = 0; i < size && !failed; ++i) {
+			uint8_t expect = frame[FRAME_HEADER_SZ + i], data;
+
+			if (read_byte(&data)) {
+				Serial.write(READ_FAILED);
+				write_u24(address + i);
+				failed = true;
+				break;
+			}
+			if (data == expect)
+				continue;
+			++diffs;
+			if (open && address + i - end >= DIFF_GAP) {
+				diff_range(start, end, erase);
+				open = false;
+			}
+			if (!open) {
+				start = address + i;
+				erase = false;
+				open = true;
+			}
+			end = address + i + 1;
+			/* Programming only clears bits */
+			erase = erase || (expect & data) != expect;
+		}
+
+		window_release();
+		if (size == 0) {
+			if (open && !failed)
+				diff_range(start, end, erase);
+			Serial.write(size);
+			write_u24(diffs);
+			window_open = false;
+			return;
+		}
+		if (!failed)
+			Serial.write(size);
+	}
+}
+
+/*
+ * Whether the UART gets within 2% of rate, the dividers are computed like
+ * HardwareSerial::begin() does with double speed
+ */
+static bool baud_supported(uint32_t rate)
+{
+#if defined(UBRR0H)
+	uint32_t divider, actual;
+
+	if (rate == 0 || rate > F_CPU / 8)
+		return false;
+	divider = (F_CPU / 4 / rate - 1) / 2;
+	actual = F_CPU / 8 / (divider + 1);
+	return (actual > rate ? actual - rate : rate - actual) * 50 < rate;
+#else
+	return rate != 0;
+#endif
+}
+
+/*
+ * Receives the test pattern within BAUD_SETTLE_MS, echoes it and waits for
+ * the client to commit the new rate
+ */
+static bool check_baud_rate()
+{
+	unsigned long start = millis();
+	uint8_t received = 0;
+	bool intact = true;
+
+	while (received < sizeof(BAUD_PATTERN)
+	       && millis() - start < BAUD_SETTLE_MS) {
+		int b = Serial.read();
+
+		if (b == -1)
+			continue;
+		intact = intact && b == BAUD_PATTERN[received];
+		++received;
+	}
+	if (!intact || received < sizeof(BAUD_PATTERN))
+		return false;
+	Serial.write(BAUD_PATTERN, sizeof(BAUD_PATTERN));
+
+	start = millis();
+	while (millis() - start < BAUD_SETTLE_MS) {
+		int b = Serial.read();
+
+		if (b == -1)
+			continue;
+		if (b != 0x47)
+			return false;
+		Serial.write(1);
+		return true;
+	}
+	return false;
+}
+
+static void set_baud_rate()
+{
+	uint8_t b[4] = {0};
+	uint32_t rate, previous = baud_rate;
+	unsigned long quiet;
+
+	Serial.readBytes(b, 4);
+	rate = (uint32_t) b[0] << 24 | (uint32_t) b[1] << 16
+		| (uint32_t) b[2] << 8 | b[3];
+	if (!baud_supported(rate)) {
+		Serial.write(0);
+		return;
+	}
+	Serial.write(1);
+	Serial.flush();
+	Serial.begin(rate);
+	if (check_baud_rate()) {
+		baud_rate = rate;
+		return;
+	}
+
+	/* Whatever the client still sends at the wrong rate is garbage */
+	quiet = millis();
+	while (millis() - quiet < BAUD_SETTLE_MS) {
+		if (Serial.read() != -1)
+			quiet = millis();
+	}
+	Serial.begin(previous);
+}
+
+/* Lets the client tell the time spent on the link from its own */
+static void loopback()
+{
+	uint8_t mode = serial_read_one_byte();
+	uint16_t count = (uint16_t) serial_read_one_byte() << 8;
+	unsigned long first = 0, last = 0;
+
+	count |= serial_read_one_byte();
+	if (mode == LOOPBACK_SOURCE) {
+		first = micros();
+		for (uint16_t i = 0; i < count; ++i)
+			Serial.write((uint8_t) i);
+		Serial.flush();
+		last = micros();
+	}
+	for (uint16_t i = 0; i < count && mode != LOOPBACK_SOURCE; ++i) {
+		uint8_t b;
+
+		if (Serial.readBytes(&b, 1) != 1) {
+			last = first;
+			break;
+		}
+		last = micros();
+		if (i == 0)
+			first = last;
+		if (mode == LOOPBACK_ECHO)
+			Serial.write(b);
+	}
+	write_u32(first);
+	write_u32(last);
+}
+
+/* Picks the modules the next commands go to, see 0x4a */
+static void select_modules()
+{
+	uint8_t mask = serial_read_one_byte() & ((1 << MODULES) - 1);
+
+	if (mask) {
+		active = mask;
+		modules_failed = 0;
+		select_module(first_active());
+	}
+	Serial.write(mask);
+}
+
+static void modules_status()
+{
+	Serial.write(modules_failed);
+	for (uint8_t m = 0; m < MODULES; ++m) {
+		if (modules_failed & 1 << m)
+			write_u24(module_failed_at[m]);
+	}
+}
+
+static void hello()
+{
+	static const uint8_t FIELDS_SZ = 12;
+
+	Serial.write(BRIDGE_MAGIC);
+	Serial.write(FIELDS_SZ);
+	Serial.write(PROTOCOL_VERSION);
+	write_u16(CAP_WRITE_EXTENTS | CAP_CALIBRATE | CAP_ERASE
+		  | CAP_CHECKSUM | CAP_STREAM_ABORT | CAP_FAST
+		  | (NATIVE_USB ? 0 : CAP_BAUD) | CAP_LOOPBACK | CAP_PENTADS
+		  | CAP_MODULES | CAP_DIFF);
+	write_u32(NATIVE_USB ? 0 : baud_rate);
+	write_u16(RX_BUFFER_SIZE);
+	Serial.write(WINDOW_SLOTS);
+	Serial.write(FRAME_MAX_DATA_SZ);
+	Serial.write(MODULES);
+}
+
+static void extended_command(uint8_t d)
+{
+	switch (d) {
+	case 0x41: /* Accelerated function to write extents */
+		write_extents();
+		outp_all(&STREAM_END, 1);
+		break;
+	case 0x42:
+		calibrate_handshake();
+		break;
+	case 0x43:
+		set_handshake_spin();
+		break;
+	case 0x44:
+		erase_chip();
+		break;
+	case 0x45:
+		checksum_stream();
+		break;
+	case 0x46:
+		fast_mode = serial_read_one_byte() == 1;
+		break;
+	case 0x47:
+		set_baud_rate();
+		break;
+	case 0x48:
+		loopback();
+		break;
+	case 0x49:
+		pentads();
+		break;
+	case 0x4a:
+		select_modules();
+		break;
+	case 0x4b:
+		modules_status();
+		break;
+	case 0x4c:
+		diff_stream();
+		outp(STREAM_END);
+		break;
+	case 0x7f:
+		hello();
+		break;
+	default: /* in/read operation */
+		inb();
+		break;
+	}
+}
+
 void loop()
 {
 	uint8_t d = serial_read_one_byte();
 
 	switch(d & 0xC0) {
 	case 0x00: /* out/write operation */
-		outb(d);
+		outb_all(d);
 		break;
-	case 0x40: /* in/read operation */
-		inb();
+	case 0x40: /* in/read operation or extended command */
+		extended_command(d);
 		break;
 	case 0x80: /* Accelerated function to write a stream of bytes */
-		if (read_byte_stream(d))
-			delay(10000); /* Sleep 10s to timeout the PC */
+		read_byte_stream(d);
 		outp(0x0);
 		break;
 	case 0xC0: /* Accelerated function to write a stream of byte */
-		if (write_byte_stream(d))
-			delay(10000); /* Sleep 10s to timeout the PC */
+		write_byte_stream(d);
 		outp(0x0);
 		break;
 	default:
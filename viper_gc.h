@@ -0,0 +1,422 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "dump.h"
+#include "progress.h"
+#include "stats.h"
+
+/*
+ * Viper GC pentad protocol, common to all transports.
+ *
+ * These helpers are all static inline and take the port accessors of the
+ * transport as a parameter: backends call them with a constant struct port_io
+ * so that their hot loops are compiled with direct calls to their own
+ * accessors instead of going through the transport interface for every bit.
+ */
+
+static const uint8_t CMD_RESET		= 0x00;
+static const uint8_t CMD_ERASE		= 0x03;
+static const uint8_t CMD_WRITE_BYTE	= 0x05;
+static const uint8_t CMD_READ_INIT	= 0x11;
+static const uint8_t CMD_READ		= 0x0d;
+static const uint8_t CMD_CHIP_INIT[]    = {0xff, 0x0c, 0x12};
+
+static const uint8_t MASK_CHIP_DATA	= 0x10;	/* PIN 13 in status register */
+static const uint8_t MASK_CHIP_ERR	= 0x08;	/* PIN 15 in status register */
+
+static const uint32_t BIOS_SIZE = (uint32_t) 0x20000;
+
+struct port_io {
+	void (*outb)(uint8_t data);	/* Data register */
+	uint8_t (*inb)(void);		/* Status register */
+	/*
+	 * Optional, transports with a high latency can queue status reads
+	 * and return their results later, in order. At most 64 of them can
+	 * be waiting to be fetched.
+	 */
+	void (*inb_post)(void);
+	uint8_t (*inb_fetch)(void);
+	/*
+	 * Optional, sends count pentads at once and checks their ACKs close to
+	 * the chip. Returns -1 if it can't, they then go one by one.
+	 */
+	int (*pentads)(const uint8_t *data, uint8_t count);
+};
+
+/* ACK latencies recorded by safe_mode_check() while calibrating */
+struct ack_record {
+	uint32_t *samples;
+	uint32_t count;
+	uint32_t max;
+};
+
+extern _Thread_local struct ack_record g_ack_record;
+
+static inline void track_progress(uint32_t done, uint32_t total)
+{
+	if (g_cfg.progress) {
+		atomic_store(&g_cfg.progress->done, done);
+		atomic_store(&g_cfg.progress->total, total);
+	}
+}
+
+/* The farm mode prints the progress of all of its devices on its own */
+static inline void print_progress(uint32_t done, uint32_t total)
+{
+	track_progress(done, total);
+	if (!g_cfg.progress)
+		progress_report(done, total);
+}
+
+/* Hands what was read so far to the dump of read_bios(), if any */
+static inline void dump_progress(const uint8_t *data, uint32_t done)
+{
+	if (g_cfg.dump)
+		dump_update(g_cfg.dump, data, done);
+}
+
+/*
+ * Sleeps between two ACK polls. Low latency mode sleeps until deadlines
+ * following each other so that late wakeups don't add up.
+ */
+static inline void ack_backoff(struct timespec *deadline, uint8_t tries)
+{
+	const uint32_t us = (1 << tries) * 125; /* 125us, 250us, 500us */
+
+	if (!g_cfg.low_latency) {
+		usleep(us);
+		return;
+	}
+	if (tries == 0)
+		clock_gettime(CLOCK_MONOTONIC, deadline);
+	deadline->tv_nsec += us * 1000;
+	if (deadline->tv_nsec >= 1000000000) {
+		deadline->tv_nsec -= 1000000000;
+		++deadline->tv_sec;
+	}
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, deadline, NULL))
+		;
+}
+
+static inline bool chip_acked(const struct port_io *io, bool high)
+{
+	uint8_t r = io->inb() & MASK_CHIP_ERR;
+
+	return (high && r != 0) || (!high && r == 0);
+}
+
+static inline int safe_mode_check(const struct port_io *io, bool high)
+{
+	static const uint8_t MAX_TRIES = ACK_TIERS;
+	struct timespec start, deadline;
+
+	/*
+	 * Chip ACKs by setting pin 15 to high, poll it for as long as it
+	 * usually takes before falling back to sleeping
+	 */
+	if (g_cfg.spin_us) {
+		const uint64_t spin_ns = (uint64_t) g_cfg.spin_us * 1000;
+		uint64_t elapsed;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		do {
+			bool acked = chip_acked(io, high);
+
+			elapsed = elapsed_ns(&start);
+			if (acked) {
+				if (g_ack_record.count < g_ack_record.max)
+					g_ack_record.samples[g_ack_record.count++]
+						= elapsed;
+				stats_ack(0, elapsed);
+				return 0;
+			}
+		} while (elapsed < spin_ns);
+	} else {
+		stats_start(&start);
+	}
+
+	for (uint8_t tries = 0; tries < MAX_TRIES; ++tries) {
+		if (chip_acked(io, high)) {
+			stats_ack(tries, stats_stop(&start));
+			return 0;
+		}
+		ack_backoff(&deadline, tries);
+	}
+	stats_ack_timeout(stats_stop(&start));
+	return 1;
+}
+
+/* Gives the chip the time it usually takes to ACK, in fast mode */
+static inline void pace_pentad(void)
+{
+	const uint64_t pace_ns = (uint64_t) g_cfg.spin_us * 1000;
+	struct timespec start;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (elapsed_ns(&start) < pace_ns)
+		;
+}
+
+/* Only in safe mode, the ACKs are always checked by the other side */
+static inline int outp_batch(const struct port_io *io, const uint8_t *data,
+			     uint8_t count)
+{
+	if (!io->pentads || !g_cfg.safe_mode || g_cfg.paced)
+		return -1;
+	return io->pentads(data, count);
+}
+
+/* Writes 5 bits (a pentad) encoded on 6 wires and check for errors */
+static inline int outp(const struct port_io *io, uint8_t data)
+{
+	uint8_t formatted_data = data & 0xf;
+	int r;
+
+	++g_stats.pentads;
+	r = outp_batch(io, &data, 1);
+	if (r >= 0)
+		return r;
+
+	if (data & 0x10)
+		formatted_data = formatted_data | 0x20;
+
+	if (g_cfg.paced) {
+		io->outb(formatted_data);
+		pace_pentad();
+		io->outb(formatted_data | 0x10);
+		pace_pentad();
+		return 0;
+	}
+	io->outb(formatted_data);
+	if (g_cfg.safe_mode && safe_mode_check(io, true))
+		return 1;
+	io->outb(formatted_data | 0x10);
+	if (g_cfg.safe_mode && safe_mode_check(io, false))
+		return 1;
+	return 0;
+}
+
+/* Writes a sequence of pentads, stops at the first one that fails */
+static inline int outp_seq(const struct port_io *io, const uint8_t *data,
+			   uint8_t count)
+{
+	int r = outp_batch(io, data, count);
+
+	if (r >= 0) {
+		g_stats.pentads += count;
+		return r;
+	}
+	for (uint8_t i = 0; i < count; ++i) {
+		if (outp(io, data[i]))
+			return 1;
+	}
+	return 0;
+}
+
+/* Reads next byte in order from the chip. */
+static inline int read_byte(const struct port_io *io, uint8_t *out)
+{
+	uint8_t val[8], data = 0;
+
+	if (outp(io, CMD_READ)) {
+		eprintf("CMD_READ failed in read_byte\n");
+		return 1;
+	}
+	for (uint8_t i = 0; i < 8; ++i) {
+		if (io->inb_post)
+			io->inb_post();
+		else
+			val[i] = io->inb();
+		/* Acknowledge we've read bit number i */
+		if (outp(io, i)) {
+			eprintf("Error while ack bit %u\n", i);
+			/* Don't leave stale results for the next read */
+			for (uint8_t j = 0; io->inb_post && j <= i; ++j)
+				io->inb_fetch();
+			return 1;
+		}
+	}
+	for (uint8_t i = 0; i < 8; ++i) {
+		if (io->inb_post)
+			val[i] = io->inb_fetch();
+		/* Only keep bit 4 (Pin 13) and append it to data, 8 times to
+		   rebuild a full byte. Least significant is read first. */
+		data = ((val[i] & MASK_CHIP_DATA) << 3) | data >> 1;
+	}
+	*out = data;
+	return 0;
+}
+
+/*
+ * Sets the chip in read mode and ready to receive read commands
+ * From there on every time CMD_READ is received by the chip it will output
+ * the next byte incrementally from address 0x0 to address 0x1ffff
+ *
+ * The 4 pentads after CMD_READ_INIT might hold a start address, but the
+ * original loader only ever sends zeros and that was never checked on a chip.
+ * Reading from another address means reading up to it first.
+ */
+static inline int init_read_mode(const struct port_io *io)
+{
+	const uint8_t seq[] = {CMD_READ_INIT, 0x00, 0x00, 0x00, 0x00};
+
+	return outp_seq(io, seq, sizeof(seq));
+}
+
+/* Writes a byte of data at a given address */
+static inline int write_byte(const struct port_io *io, uint8_t data,
+			     uint32_t address)
+{
+	const uint8_t seq[] = {
+		CMD_WRITE_BYTE, ((data >> 3) & 0x1c) | ((address >> 15) & 0x3),
+		address >> 10, address >> 5, address,
+		data, data, data, data,
+	};
+	int r;
+
+	/*
+	 * Flash default value is 0xff, skip bytes that already have the correct
+	 * value and save some time
+	 */
+	if (data == 0xff)
+		return 0;
+
+	address = address & 0x1ffff;
+
+	/* In one go, unlike below a failed data pentad fails the write */
+	r = outp_batch(io, seq, sizeof(seq));
+	if (r >= 0) {
+		g_stats.pentads += sizeof(seq);
+		return r;
+	}
+	if (outp(io, CMD_WRITE_BYTE))
+		return 1;
+	/*  First 3 most significant bits of data + 2 MSBs of address */
+	if (outp(io, ((data >> 3) & 0x1c) | (address >> 15)))
+		return 1;
+	/* Then 3x5 remaining bits of address for a total of 17 address bits */
+	if (outp(io, address >> 10))
+		return 1;
+	if (outp(io, address >> 5))
+		return 1;
+	if (outp(io, address))
+		return 1;
+	/* Then the rest of the data (5 bits) */
+	for (uint8_t i = 0; i < 4; ++i)
+		outp(io, data);
+	return 0;
+}
+
+/*
+ * The chip toggles its data while erasing, it is done once two consecutive
+ * reads of its first byte match. It is ready to be programmed once that byte
+ * reads as blank, which the original loader gave it a whole second for.
+ */
+static inline int erase_and_wait(const struct port_io *io,
+				 uint32_t *elapsed_ms)
+{
+	static const uint64_t TIMEOUT_NS = 30000000000ULL;
+	static const uint64_t READY_NS = 1000000000;
+	static const uint8_t ERASE_SEQ[13] = {
+		CMD_ERASE, CMD_ERASE, CMD_ERASE, CMD_ERASE, CMD_ERASE,
+		CMD_ERASE, CMD_ERASE, CMD_ERASE, CMD_ERASE, CMD_ERASE,
+		CMD_ERASE, CMD_ERASE, CMD_ERASE,
+	};
+	struct timespec start, erased;
+	uint8_t c1, c2 = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (outp_batch(io, ERASE_SEQ, sizeof(ERASE_SEQ)) >= 0)
+		g_stats.pentads += sizeof(ERASE_SEQ);
+	else
+		for (uint8_t i = 0; i < sizeof(ERASE_SEQ); ++i)
+			outp(io, CMD_ERASE);
+
+	init_read_mode(io);
+	read_byte(io, &c2);
+	do {
+		c1 = c2;
+		init_read_mode(io);
+		read_byte(io, &c2);
+		++g_stats.erase_polls;
+		if (elapsed_ns(&start) > TIMEOUT_NS)
+			return 1;
+	} while (c1 != c2);
+
+	clock_gettime(CLOCK_MONOTONIC, &erased);
+	while (c2 != 0xff && elapsed_ns(&erased) < READY_NS) {
+		init_read_mode(io);
+		read_byte(io, &c2);
+	}
+	g_stats.erase_settle_ns += elapsed_ns(&erased);
+	*elapsed_ms = elapsed_ns(&start) / 1000000;
+	return 0;
+}
+
+/*
+ * Bulk operations one byte at a time over the port accessors, for the
+ * transports that drive the pins directly
+ */
+static inline int chip_read_range(const struct port_io *io, uint8_t *data,
+				  uint32_t size)
+{
+	for (uint32_t i = 0; i < size; i++) {
+		if (read_byte(io, &data[i])) {
+			eprintf("Error while reading at address 0x%05x\n", i);
+			return 1;
+		}
+		dump_progress(data, i + 1);
+		print_progress(i + 1, size);
+	}
+	return 0;
+}
+
+static inline int chip_write_range(const struct port_io *io,
+				   const uint8_t *data, uint32_t offset,
+				   uint32_t size, uint32_t *failed_at)
+{
+	for (uint32_t i = 0; i < size; ++i) {
+		if (write_byte(io, data[i], offset + i)) {
+			eprintf("Error while writing to the chip. "
+				"@0x%05x <- 0x%02x\n", offset + i, data[i]);
+			/* Give it a second chance */
+			if (write_byte(io, data[i], offset + i)) {
+				*failed_at = offset + i;
+				return 1;
+			}
+		}
+		print_progress(i + 1, size);
+	}
+	return 0;
+}
+
+static inline int chip_verify_range(const struct port_io *io,
+				    const uint8_t *expect, uint32_t size,
+				    uint32_t max_diffs, uint32_t *first_diff,
+				    uint32_t *diffs)
+{
+	*first_diff = size;
+	*diffs = 0;
+	for (uint32_t i = 0; i < size; ++i) {
+		uint8_t data = 0;
+
+		if (read_byte(io, &data)) {
+			eprintf("Error while reading from the chip.\n");
+			return 1;
+		}
+		if (data != expect[i]) {
+			if (*diffs == 0)
+				*first_diff = i;
+			if (++*diffs == max_diffs)
+				return 0;
+		}
+		print_progress(i + 1, size);
+	}
+	return 0;
+}
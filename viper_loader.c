@@ -1,11 +1,22 @@
+#include <limits.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <sys/io.h>
 #include <string.h>
 
-#include "config.h"
 #include "arduino_serial.h"
+#include "config.h"
+#include "crc32.h"
+#include "daemon.h"
+#include "dump.h"
+#include "farm.h"
+#include "handshake.h"
+#include "image.h"
+#include "realtime.h"
+#include "stats.h"
+#include "transport.h"
+#include "viper_gc.h"
 
 /*
  * Technical overview:
@@ -28,360 +39,956 @@
 
 static void usage_exit(const char *p, int exit_code)
 {
-	printf("Usage: %s [-h] [-u] [-p port] [-s dev] (-r out_file | -w in_file | -c in_file)\n", p);
-	printf("\t-r out_file: Dump the content of the modchip into out_file\n");
+	printf("Usage: %s [-h] [-u] [-p port] [-s dev]... [-E sim_spec] [-t timing_file] [-B max_baud] [-j stats_file] [-L] [-S socket] [-m max_diffs] [-d] [-o offset] [-l length] [-R address] [-f] [-b] [-V] (-r out_file | -w in_file | -c in_file | -v in_file | -T)\n", p);
+	printf("       %s [-u] [-p port] [-s dev]... [-t timing_file] [-B max_baud] [-j stats_file] [-L] -D socket\n", p);
+	printf("\t-r out_file: Dump the content of the modchip into out_file, along with its SHA-256 in out_file.sha256, repeat it to save copies\n");
 	printf("\t-w in_file: Write the content of in_file into the modchip\n");
 	printf("\t-c in_file: Compare the content of in_file with the content of the modchip\n");
+	printf("\t-v in_file: Quickly verify the content of the modchip against in_file with checksums of 4 KB blocks\n");
+	printf("\t-T: Measure the latency and bandwidth of the serial link with the Arduino bridge, no chip needed\n");
 	printf("Options:\n");
 	printf("\t-u: Disable safe mode\n");
 	printf("\t-p: Use specified IO port address in hexadecimal (default is 0x378)\n");
-	printf("\t-s: Use Arduino serial bridge connected to dev (example /dev/ttyUSB0)\n");
+	printf("\t-s: Use Arduino serial bridge connected to dev (example /dev/ttyUSB0), repeat it to work on several devices at once. dev@0,2 or dev@all writes several modules of a Mega bridge at once\n");
+	printf("\t-E: Use a simulated chip instead, sim_spec is state_file[,latency=ns][,erase=ms][,fail=n][,drop=n]\n");
+	printf("\t-t: Load handshake timings of the device from timing_file, calibrate and save them if missing\n");
+	printf("\t-B: Don't switch the serial link to rates above max_baud (default is 4000000, 0 keeps the rate the bridge was built with)\n");
+	printf("\t-j: Write the counters and timings of each device (or daemon job) to stats_file, one JSON object per line\n");
+	printf("\t-L: Low latency mode, run with real-time priority, locked memory, minimal timer slack and pinned to a CPU (needs root)\n");
+	printf("\t-D: Keep the devices open and run the jobs received on socket\n");
+	printf("\t-S: Send the job to the daemon listening on socket, -s picks one of its devices\n");
+	printf("\t-d: Only program the bytes that changed when writing, unless the chip has to be erased\n");
+	printf("\t-o: Start reading, writing or comparing at offset instead of address 0, in_file holds the data for that address\n");
+	printf("\t-l: Only read, write or compare length bytes (the default is up to the end of the chip or of in_file)\n");
+	printf("\t-f: Write without waiting for ACKs, then check every 4 KB block and program the bad ones again in safe mode\n");
+	printf("\t-V: Verify the modchip against in_file right after writing it, like -v but without opening the device again\n");
+	printf("\t-b: Check whether the chip is blank before writing and skip the erase if it is, from CRCs with the Arduino bridge, otherwise a blank chip is read entirely\n");
+	printf("\t-R: Resume writing at address without erasing the chip, after a failure\n");
+	printf("\t-m: Stop comparing after max_diffs differences (default is 1, 0 compares everything and lists the ranges that differ if the Arduino bridge can)\n");
 	printf("\t-h: Displays this usage message\n");
 	exit(exit_code);
 }
 
-static const uint8_t CMD_RESET		= 0x00;
-static const uint8_t CMD_ERASE		= 0x03;
-static const uint8_t CMD_WRITE_BYTE	= 0x05;
-static const uint8_t CMD_READ_INIT[]	= {0x11, 0x00, 0x00, 0x00, 0x00};
-static const uint8_t CMD_READ		= 0x0d;
-static const uint8_t CMD_CHIP_INIT[]    = {0xff, 0x0c, 0x12};
-
-static const uint8_t MASK_CHIP_DATA	= 0x10;	/* PIN 13 in status register */
-static const uint8_t MASK_CHIP_ERR	= 0x08;	/* PIN 15 in status register */
-
-struct config g_cfg = {
+_Thread_local struct config g_cfg = {
 	.operation = OP_UNSET,
 	.port = 0x378,
 	.serial = -1,
+	.max_baud = 4000000,
 	.safe_mode = true,
+	.max_diffs = 1,
 	.timeout = {
 		.tv_sec = 1,
 	},
 };
-static const uint32_t BIOS_SIZE = (uint32_t) 0x20000;
+_Thread_local struct ack_record g_ack_record;
+
+/* Devices given with -s, more than one selects the farm mode */
+#define MAX_DEVICES 64
+static const char *g_devices[MAX_DEVICES];
+static unsigned int g_device_count;
+
+/* Socket of the daemon to run as or to send the job to */
+static const char *g_daemon_socket;
+static const char *g_submit_socket;
 
-static void _outb(uint8_t data)
+/* Report of the stats, see stats.h */
+static const char *g_stats_path;
+
+void eprintf(const char *format, ...)
 {
-	if (use_serial())
-		serial_outb(data);
-	else
-		outb(data, g_cfg.port);
+	char msg[512];
+	const char *start = msg;
+	va_list ap;
+
+	va_start(ap, format);
+	vsnprintf(msg, sizeof(msg), format, ap);
+	va_end(ap);
+	if (g_cfg.err) {
+		fputs(msg, g_cfg.err);
+		return;
+	}
+	if (!g_cfg.progress) {
+		fputs(msg, stderr);
+		return;
+	}
+	/* Replace the progress line of the farm instead of breaking it */
+	while (*start == '\n')
+		++start;
+	fprintf(stderr, "\r%79s\r%s: %s", "", g_cfg.serial_dev, start);
 }
 
-static uint8_t _inb()
+/* Granularity of -v and of the checks after writing in fast mode */
+static const uint32_t VERIFY_BLOCK_SZ = 0x1000;
+
+/* Generic accessors going through the transport, for the short sequences */
+static inline const struct port_io *chip_io(void)
 {
-	if (use_serial())
-		return serial_inb();
-	else
-		return inb(g_cfg.port + 1);
+	return &g_cfg.transport->io;
 }
 
-static int safe_mode_check(bool high)
+/* Only a part of the chip was selected with -o or -l */
+static inline bool windowed(void)
 {
-	static const uint8_t MAX_TRIES = 4;
-
-	/* Chip ACKs by setting pin 15 to high */
-	for (uint8_t tries = 0; tries < MAX_TRIES; ++tries) {
-		uint8_t r = _inb() & MASK_CHIP_ERR;
-		if ((high && r != 0) || (!high && r == 0))
-			return 0;
-		usleep((1 << tries) * 125); /* 125us, 250us, 500us */
-	}
-	return 1;
+	return g_cfg.offset || g_cfg.length;
 }
 
-/* Writes 5 bits (a pentad) encoded on 6 wires and check for errors */
-static int outp(uint8_t data)
+/*
+ * Sets the chip in read mode at address offset, the bytes before it are read
+ * and thrown away (see init_read_mode()) without going into the dump
+ */
+static int init_read_mode_at(uint32_t offset)
 {
-	uint8_t formatted_data = data & 0xf;
-
-	if (data & 0x10)
-		formatted_data = formatted_data | 0x20;
+	uint8_t skipped[BIOS_SIZE];
+	struct dump *dump = g_cfg.dump;
+	int r;
 
-	_outb(formatted_data);
-	if (g_cfg.safe_mode && safe_mode_check(true))
-		return 1;
-	_outb(formatted_data | 0x10);
-	if (g_cfg.safe_mode && safe_mode_check(false))
+	if (init_read_mode(chip_io()))
 		return 1;
-	return 0;
+	if (offset == 0)
+		return 0;
+	g_cfg.dump = NULL;
+	r = g_cfg.transport->read_range(skipped, offset);
+	g_cfg.dump = dump;
+	return r;
 }
 
-/* Reads next byte in order from the chip. */
-static int read_byte(uint8_t *out)
+/* Reads size bytes of the chip starting at address offset */
+static int read_chip(uint8_t *data, uint32_t offset, uint32_t size)
 {
-	uint8_t val, data = 0;
+	struct timespec start;
+	int r;
 
-	if (outp(CMD_READ)) {
-		eprintf("CMD_READ failed in read_byte\n");
+	if (size == 0)
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (init_read_mode_at(offset)) {
+		eprintf("Error while initializing the chip for reading\n");
+		outp(chip_io(), CMD_RESET);
 		return 1;
 	}
-	for (uint8_t i = 0; i < 8; ++i) {
-		val = _inb();
-		/* Only keep bit 4 (Pin 13) and append it to data, 8 times to
-		   rebuild a full byte. Least significant is read first. */
-		data = ((val & MASK_CHIP_DATA) << 3) | data >> 1;
-		/* Acknowledge we've read bit number i */
-		if (outp(i)) {
-			eprintf("Error while ack bit %u\n", i);
-			return 1;
-		}
+	r = g_cfg.transport->read_range(data, size);
+	outp(chip_io(), CMD_RESET);
+	stats_phase(PHASE_READ, size, &start);
+	if (r) {
+		fflush(stdout);
+		eprintf("\nError while reading from the chip.\n");
 	}
-	*out = data;
-	return 0;
+	return r;
 }
 
 /*
- * Sets the chip in read mode and ready to receive read commands
- * From there on every time CMD_READ is received by the chip it will output
- * the next byte incrementally from address 0x0 to address 0x1ffff
+ * Where the chip differs from expect (for address offset onwards), compared
+ * by the transport. Returns -1 if it can't, there is nothing to fall back on
+ * here.
  */
-static int init_read_mode()
+static int diff_chip(const uint8_t *expect, uint32_t offset, uint32_t size,
+		     struct diff_map *map)
 {
-	return outp(CMD_READ_INIT[0]) || outp(CMD_READ_INIT[1])
-	    || outp(CMD_READ_INIT[2]) || outp(CMD_READ_INIT[3])
-	    || outp(CMD_READ_INIT[4]);
-}
-
-static int read_bios()
-{
-	FILE *file;
-	uint8_t bios_buffer[BIOS_SIZE];
-	const uint32_t one_percent = BIOS_SIZE / 100;
-	uint32_t i = 0;
+	struct timespec start;
+	int r;
 
-	printf("Reading bios to file %s\n", g_cfg.file_path);
-	if (init_read_mode()) {
+	if (!g_cfg.transport->diff_range)
+		return -1;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (init_read_mode_at(offset)) {
 		eprintf("Error while initializing the chip for reading\n");
-		outp(CMD_RESET);
+		outp(chip_io(), CMD_RESET);
 		return 1;
 	}
-	printf("Reading...\n");
-
-	/*
-	* If using the Arduino bridge, use the Arduino-accelerated
-	* version to reduce serial communication bottlenecks.
-	*/
-	if (use_serial() && serial_read_byte_stream(bios_buffer, BIOS_SIZE)) {
+	r = g_cfg.transport->diff_range(expect, offset, size, map);
+	outp(chip_io(), CMD_RESET);
+	if (r < 0)
+		return r;
+	stats_phase(PHASE_COMPARE, size, &start);
+	if (r) {
 		fflush(stdout);
 		eprintf("\nError while reading from the chip.\n");
 	}
-	for (i = 0; !use_serial() && i < BIOS_SIZE; i++) {
-		if (read_byte(&bios_buffer[i])) {
-			eprintf("Error while reading at address 0x%05x\n", i);
-			break;
-		}
+	return r;
+}
 
-		if (i % one_percent == 0) {
-			printf("\r%02u%% done", i / one_percent);
-			fflush(stdout);
-		}
-	}
+static int save_file(const char *path, const uint8_t *data, uint32_t size)
+{
+	FILE *file = fopen(path, "wb+");
 
-	outp(CMD_RESET);
-	printf("\nRead complete\n");
-	file = fopen(g_cfg.file_path, "wb+");
 	if (!file) {
 		eprintf("Couldn't create file '%s', check access rights\n",
-			g_cfg.file_path);
+			path);
 		return 1;
 	}
-	fwrite(bios_buffer, 1, BIOS_SIZE, file);
+	fwrite(data, 1, size, file);
 	fclose(file);
 	return 0;
 }
 
-/* Writes a byte of data at a given address */
-static int write_byte(uint8_t data, uint32_t address)
+/* The files are written and hashed while the chip is being read */
+static int read_bios()
 {
-	/*
-	 * Flash default value is 0xff, skip bytes that already have the correct
-	 * value and save some time
-	 */
-	if (data == 0xff)
-		return 0;
-
-	address = address & 0x1ffff;
+	uint8_t bios_buffer[BIOS_SIZE];
+	uint32_t size = g_cfg.length ? g_cfg.length : BIOS_SIZE - g_cfg.offset;
+	const char *paths[MAX_DUMP_FILES] = {g_cfg.file_path};
+	struct dump dump;
+	int r;
 
-	if (outp(CMD_WRITE_BYTE))
+	for (unsigned int i = 0; i < g_cfg.copies; ++i)
+		paths[i + 1] = g_cfg.copy_paths[i];
+	if (dump_open(&dump, paths, g_cfg.copies + 1))
 		return 1;
-	/*  First 3 most significant bits of data + 2 MSBs of address */
-	if (outp(((data >> 3) & 0x1c) | (address >> 15)))
+	for (unsigned int i = 0; i <= g_cfg.copies; ++i)
+		printf("Reading bios to file %s\n", paths[i]);
+	printf("Reading...\n");
+	g_cfg.dump = &dump;
+	r = read_chip(bios_buffer, g_cfg.offset, size);
+	g_cfg.dump = NULL;
+	if (r == 0)
+		printf("\nRead complete\n");
+	return dump_close(&dump, r == 0) || r;
+}
+
+/* Same as the transport operations, timed for the stats */
+static int write_chip(const uint8_t *data, uint32_t offset, uint32_t size,
+		      uint32_t *failed_at)
+{
+	struct timespec start;
+	int r;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	r = g_cfg.transport->write_range(data, offset, size, failed_at);
+	stats_phase(PHASE_WRITE, size, &start);
+	return r;
+}
+
+static int compare_chip(const uint8_t *expect, uint32_t size,
+			uint32_t max_diffs, uint32_t *first_diff,
+			uint32_t *diffs)
+{
+	struct timespec start;
+	int r;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	r = g_cfg.transport->verify_range(expect, size, max_diffs, first_diff,
+					  diffs);
+	stats_phase(PHASE_COMPARE, size, &start);
+	return r;
+}
+
+static int erase_chip()
+{
+	struct timespec start;
+	uint32_t elapsed_ms;
+	int r;
+
+	printf("Erasing memory... ");
+	fflush(stdout);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	r = g_cfg.transport->erase(&elapsed_ms);
+	stats_phase(PHASE_ERASE, 0, &start);
+	if (r) {
+		printf("Failed\n");
 		return 1;
-	/* Then 3x5 remaining bits of address for a total of 17 address bits */
-	if (outp(address >> 10))
+	}
+	printf("Done in %ums\n", elapsed_ms);
+	return 0;
+}
+
+static bool needs_image(void)
+{
+	return g_cfg.operation == OP_WRITE || g_cfg.operation == OP_COMPARE
+	       || g_cfg.operation == OP_VERIFY;
+}
+
+static int load_image(void)
+{
+	const struct image *image = image_get(g_cfg.file_path);
+
+	if (!image)
 		return 1;
-	if (outp(address >> 5))
+	if (image->size > BIOS_SIZE - g_cfg.offset) {
+		eprintf("File '%s' of size %zu won't fit on the chip at "
+			"address 0x%05x\n", g_cfg.file_path, image->size,
+			g_cfg.offset);
+		image_put(image);
 		return 1;
-	if (outp(address))
+	}
+	if (image->size < g_cfg.length) {
+		eprintf("File '%s' of size %zu is smaller than the requested "
+			"length\n", g_cfg.file_path, image->size);
+		image_put(image);
 		return 1;
-	/* Then the rest of the data (5 bits) */
-	for (uint8_t i = 0; i < 4; ++i)
-		outp(data);
+	}
+	g_cfg.image = image;
 	return 0;
 }
 
-static void erase_chip()
+/*
+ * Copies the data meant for the window of the chip selected with -o and -l,
+ * returns the size of the window
+ */
+static ssize_t load_bios_file(void *buffer)
 {
-	uint8_t c1, c2;
+	uint32_t size = g_cfg.length ? g_cfg.length : g_cfg.image->size;
 
-	printf("Erasing memory... ");
+	memcpy(buffer, g_cfg.image->data, size);
+	return size;
+}
 
-	for (uint8_t i = 0; i < 13; ++i)
-		outp(CMD_ERASE);
+/*
+ * Same as delta_from_chip() from the ranges that differ, the bytes that match
+ * within them are programmed again to no effect
+ */
+static void delta_from_map(const uint8_t *image, uint8_t *delta,
+			   const struct diff_map *map, uint32_t *offset,
+			   uint32_t *size, bool *need_erase)
+{
+	*need_erase = map->erase;
+	if (*need_erase)
+		return;
+	memset(&delta[*offset], 0xff, *size);
+	for (uint32_t i = 0; i < map->count; ++i)
+		memcpy(&delta[map->ranges[i].start],
+		       &image[map->ranges[i].start], map->ranges[i].size);
+	if (map->count) {
+		uint32_t last = map->count - 1;
 
-	init_read_mode();
-	read_byte(&c2);
-	do {
-		c1 = c2;
-		init_read_mode();
-		read_byte(&c2);
-	} while (c1 != c2);
-	printf("Done\n");
+		*offset = map->ranges[0].start;
+		*size = map->ranges[last].start + map->ranges[last].size
+			- *offset;
+	} else {
+		*size = 0;
+	}
+	printf("%u byte(s) to program, no need to erase\n", map->diffs);
 }
 
-static ssize_t load_bios_file(void *buffer)
+/*
+ * Programming can only clear bits, the chip only has to be erased when the
+ * image sets some of them back to 1. Otherwise delta gets a copy of the image
+ * where the bytes that are already right are replaced by 0xff so that the
+ * transports skip them, and the range to program is narrowed down to the
+ * bytes that changed.
+ */
+static int delta_from_chip(const uint8_t *image, uint8_t *delta,
+			   uint32_t *offset, uint32_t *size, bool *need_erase)
 {
-	size_t size, read;
-	FILE *f = fopen(g_cfg.file_path, "rb");
+	uint8_t current[BIOS_SIZE];
+	uint32_t changed = 0, first = *offset + *size, last = 0;
+	struct diff_map map;
+	int r;
 
-	if (!f) {
-		eprintf("Could not open file '%s'\n", g_cfg.file_path);
-		return -1;
+	printf("Comparing the chip with the image...\n");
+	r = diff_chip(&image[*offset], *offset, *size, &map);
+	if (r >= 0) {
+		printf("\n");
+		if (r == 0)
+			delta_from_map(image, delta, &map, offset, size,
+				       need_erase);
+		return r;
 	}
-	fseek(f, 0, SEEK_END);
-	size = ftell(f);
-	if (size > BIOS_SIZE) {
-		eprintf("File '%s' of size %zu won't fit on the chip\n",
-			g_cfg.file_path, size);
+
+	if (read_chip(&current[*offset], *offset, *size))
+		return 1;
+	printf("\n");
+
+	for (uint32_t i = *offset; i < *offset + *size; ++i) {
+		if ((image[i] & current[i]) != image[i]) {
+			*need_erase = true;
+			return 0;
+		}
+	}
+	*need_erase = false;
+	for (uint32_t i = *offset; i < *offset + *size; ++i) {
+		delta[i] = image[i] == current[i] ? 0xff : image[i];
+		if (image[i] == current[i])
+			continue;
+		if (changed++ == 0)
+			first = i;
+		last = i;
+	}
+	*offset = first;
+	*size = changed ? last - first + 1 : 0;
+	printf("%u byte(s) to program, no need to erase\n", changed);
+	return 0;
+}
+
+/* CRC32 of each block of the chip, computed by the transport if it can */
+static int checksum_chip(uint32_t size, uint32_t block_sz, uint32_t *crcs)
+{
+	uint8_t actual[BIOS_SIZE];
+	struct timespec start;
+	int r;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	r = -1;
+	if (g_cfg.transport->checksum_range)
+		r = g_cfg.transport->checksum_range(size, block_sz, crcs);
+	if (r < 0) {
+		r = g_cfg.transport->read_range(actual, size);
+		if (r == 0)
+			crc32_blocks(actual, size, block_sz, crcs);
+	}
+	stats_phase(PHASE_CHECKSUM, size, &start);
+	return r;
+}
+
+/*
+ * Compares the CRC32 of each block of the chip from address offset with the
+ * expected data, returns the number of blocks that differ or -1 on error
+ */
+static int find_bad_blocks(const uint8_t *expect, uint32_t offset,
+			   uint32_t size, bool *bad)
+{
+	uint32_t crcs[BIOS_SIZE / VERIFY_BLOCK_SZ];
+	int bad_blocks = 0;
+
+	if (init_read_mode_at(offset)) {
+		eprintf("Error while initializing the chip for reading\n");
+		outp(chip_io(), CMD_RESET);
 		return -1;
 	}
-	fseek(f, 0, SEEK_SET);
-	read = fread(buffer, 1, size, f);
-	fclose(f);
-	if (read != size) {
-		eprintf("Failed to read all bytes from '%s'\n",
-			g_cfg.file_path);
+	if (checksum_chip(size, VERIFY_BLOCK_SZ, crcs)) {
+		fflush(stdout);
+		eprintf("\nError while reading from the chip.\n");
+		outp(chip_io(), CMD_RESET);
 		return -1;
 	}
-	return size;
+	outp(chip_io(), CMD_RESET);
+	printf("\n");
+	fflush(stdout);
+
+	for (uint32_t i = 0; i < size; i += VERIFY_BLOCK_SZ) {
+		uint32_t block_sz = size - i < VERIFY_BLOCK_SZ ? size - i
+			: VERIFY_BLOCK_SZ;
+
+		bad[i / VERIFY_BLOCK_SZ] =
+			crcs[i / VERIFY_BLOCK_SZ] != crc32(&expect[i], block_sz);
+		bad_blocks += bad[i / VERIFY_BLOCK_SZ];
+	}
+	return bad_blocks;
 }
 
-static int write_bios()
+/*
+ * Fast mode doesn't wait for the chip to ACK pentads, so every block is
+ * checked once done and the bytes that didn't make it are programmed again in
+ * safe mode. Returns -1 if a block has to be erased to be fixed.
+ */
+static int fix_bad_blocks(const uint8_t *image, uint32_t offset, uint32_t size,
+			  uint32_t *failed_at)
 {
-	uint8_t buffer[BIOS_SIZE];
-	ssize_t size = load_bios_file(buffer);
-	const uint32_t one_percent = size / 100;
+	bool bad[BIOS_SIZE / VERIFY_BLOCK_SZ];
+	uint8_t delta[BIOS_SIZE];
+	int bad_blocks;
 
-	if (size <= 0)
+	printf("Checking blocks...\n");
+	bad_blocks = find_bad_blocks(&image[offset], offset, size, bad);
+	if (bad_blocks < 0)
 		return 1;
+	if (bad_blocks == 0)
+		return 0;
+	printf("%d block(s) to program again in safe mode\n", bad_blocks);
 
-	erase_chip();
-	usleep(1000000); // 1 second
+	for (uint32_t i = 0; i < size; i += VERIFY_BLOCK_SZ) {
+		uint32_t start = offset + i;
+		uint32_t block_sz = size - i < VERIFY_BLOCK_SZ ? size - i
+			: VERIFY_BLOCK_SZ;
+		bool need_erase, still_bad;
 
-	printf("Flashing memory...\n");
+		if (!bad[i / VERIFY_BLOCK_SZ])
+			continue;
+		if (delta_from_chip(image, delta, &start, &block_sz,
+				    &need_erase))
+			return 1;
+		if (need_erase) {
+			eprintf("Block at 0x%05x can't be fixed without "
+				"erasing the chip\n", offset + i);
+			return -1;
+		}
+		if (block_sz && write_chip(&delta[start], start, block_sz,
+					   failed_at))
+			return 1;
+		outp(chip_io(), CMD_RESET);
+		bad_blocks = find_bad_blocks(&image[offset + i], offset + i,
+					     size - i < VERIFY_BLOCK_SZ ? size - i
+								: VERIFY_BLOCK_SZ,
+					     &still_bad);
+		if (bad_blocks < 0)
+			return 1;
+		if (bad_blocks > 0) {
+			eprintf("Block at 0x%05x still differs\n", offset + i);
+			*failed_at = offset + i;
+			return 1;
+		}
+	}
+	return 0;
+}
 
-	/*
-	 * If using the Arduino bridge, use the Arduino-accelerated version to
-	 * avoid serial communication bottlenecks.
-	 */
-	if (use_serial() && serial_write_byte_stream(buffer, size)) {
-		fflush(stdout);
-		eprintf("\nError while writing to the chip.\n");
-		return 1;
+/*
+ * Programs the range in fast mode when it is enabled and supported by the
+ * transport, image is what the chip should hold once done
+ */
+static int program_range(const uint8_t *program, const uint8_t *image,
+			 uint32_t offset, uint32_t size, uint32_t *failed_at)
+{
+	const struct transport *t = g_cfg.transport;
+	int r;
+
+	if (!g_cfg.fast)
+		return write_chip(&program[offset], offset, size, failed_at);
+	if (!t->set_fast || t->set_fast(true)) {
+		printf("Fast mode is not available, writing in safe mode\n");
+		return write_chip(&program[offset], offset, size, failed_at);
 	}
 
-	/* Main writing loop */
-	for (uint32_t i = 0; !use_serial() && i < (uint32_t) size; ++i) {
-		if (write_byte(buffer[i], i)) {
-			eprintf("Error while writing to the chip. "
-				"@0x%05x <- 0x%02x\n", i, buffer[i]);
-			/* Give it a second chance */
-			if (write_byte(buffer[i], i))
-				return 1;
+	r = write_chip(&program[offset], offset, size, failed_at);
+	t->set_fast(false);
+	outp(chip_io(), CMD_RESET);
+	if (r)
+		return r;
+	return fix_bad_blocks(image, offset, size, failed_at);
+}
+
+/*
+ * Bridges only send back the CRC32 of each block. Otherwise the streaming
+ * compare stops at the first programmed byte, so blank chips are read
+ * entirely.
+ */
+static bool chip_is_blank(void)
+{
+	uint8_t blank[BIOS_SIZE];
+	uint32_t crcs[BIOS_SIZE / VERIFY_BLOCK_SZ];
+	uint32_t first_diff, diffs;
+	struct timespec start;
+	int r = -1;
+
+	memset(blank, 0xff, BIOS_SIZE);
+	printf("Checking whether the chip is blank...\n");
+	if (init_read_mode(chip_io())) {
+		outp(chip_io(), CMD_RESET);
+		return false;
+	}
+	if (g_cfg.transport->checksum_range) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		r = g_cfg.transport->checksum_range(BIOS_SIZE, VERIFY_BLOCK_SZ,
+						    crcs);
+		if (r >= 0)
+			stats_phase(PHASE_CHECKSUM, BIOS_SIZE, &start);
+	}
+	if (r < 0) {
+		r = compare_chip(blank, BIOS_SIZE, 1, &first_diff, &diffs);
+	} else {
+		uint32_t blank_crc = crc32(blank, VERIFY_BLOCK_SZ);
+
+		first_diff = BIOS_SIZE;
+		for (uint32_t b = 0; b < BIOS_SIZE / VERIFY_BLOCK_SZ; ++b) {
+			if (crcs[b] != blank_crc) {
+				first_diff = b * VERIFY_BLOCK_SZ;
+				break;
+			}
 		}
+	}
+	outp(chip_io(), CMD_RESET);
+	printf("\n");
+	if (r)
+		return false;
+	if (first_diff < BIOS_SIZE)
+		printf("Address 0x%05x is programmed\n", first_diff);
+	return first_diff == BIOS_SIZE;
+}
+
+/* Tells how to pick up where writing stopped without erasing the chip again */
+static void write_failed(const uint8_t *image, uint32_t failed_at, bool merged)
+{
+	char path[sizeof(g_cfg.file_path) + 8];
+
+	fflush(stdout);
+	eprintf("\nError while writing to the chip at address 0x%05x.\n",
+		failed_at);
+	if (!merged) {
+		eprintf("Run again with -R 0x%05x to resume without erasing\n",
+			failed_at);
+		return;
+	}
+	/* The rest of the chip only exists in memory now */
+	snprintf(path, sizeof(path), "%s.resume", g_cfg.file_path);
+	if (save_file(path, image, BIOS_SIZE) == 0)
+		eprintf("Run again with -R 0x%05x -w %s and without -o or -l "
+			"to resume without erasing\n", failed_at, path);
+}
+
+static int write_bios()
+{
+	uint8_t buffer[BIOS_SIZE], delta[BIOS_SIZE];
+	const uint8_t *program = buffer;
+	uint32_t offset = g_cfg.offset, failed_at;
+	ssize_t window_size;
+	uint32_t size;
+	bool need_erase = true, merged = false;
+	int r;
+
+	memset(buffer, 0xff, BIOS_SIZE);
+	window_size = load_bios_file(&buffer[offset]);
+	if (window_size <= 0)
+		return 1;
+	size = window_size;
 
-		if (i % one_percent == 0) {
-			printf("\r%02u%% done", i / one_percent);
-			fflush(stdout);
+	if (g_cfg.resume) {
+		if (g_cfg.resume_at < offset || g_cfg.resume_at >= offset + size) {
+			eprintf("Resume address 0x%05x is out of the range "
+				"to write\n", g_cfg.resume_at);
+			return 1;
 		}
+		printf("Resuming at address 0x%05x\n", g_cfg.resume_at);
+		size -= g_cfg.resume_at - offset;
+		offset = g_cfg.resume_at;
+		need_erase = false;
+	} else if (g_cfg.delta && !windowed()) {
+		/* Past the end of the file the chip has to be blank too */
+		size = BIOS_SIZE;
+	}
+	/* The erase is chip wide, patch the window in place if possible */
+	if (!g_cfg.resume && (g_cfg.delta || windowed())) {
+		if (delta_from_chip(buffer, delta, &offset, &size,
+				    &need_erase))
+			return 1;
+		if (need_erase)
+			printf("Some bits have to be set back to 1\n");
+		else
+			program = delta;
+	}
+	if (need_erase && windowed()) {
+		uint32_t end = offset + size;
+
+		printf("Saving the rest of the chip...\n");
+		if (read_chip(buffer, 0, offset)
+		    || read_chip(&buffer[end], end, BIOS_SIZE - end))
+			return 1;
+		printf("\n");
+		offset = 0;
+		size = BIOS_SIZE;
+		merged = true;
 	}
-	outp(CMD_RESET);
+	if (need_erase && g_cfg.blank_check && !windowed() && chip_is_blank()) {
+		printf("Chip is blank, no need to erase\n");
+		need_erase = false;
+	}
+	if (need_erase && erase_chip())
+		return 1;
+	if (size == 0) {
+		printf("Chip content is already up to date.\n");
+		return 0;
+	}
+
+	printf("Flashing memory...\n");
+	r = program_range(program, buffer, offset, size, &failed_at);
+	if (r) {
+		outp(chip_io(), CMD_RESET);
+		if (r > 0)
+			write_failed(buffer, failed_at, merged);
+		return 1;
+	}
+	outp(chip_io(), CMD_RESET);
 	printf("\nFlash complete.\n");
 	return 0;
 }
 
+/* Ranges of the chip that differ from expect, unless the transport can't */
+static int list_diffs(const uint8_t *expect, uint32_t size)
+{
+	struct diff_map map;
+	int r = diff_chip(expect, g_cfg.offset, size, &map);
+
+	if (r)
+		return r;
+	if (map.diffs == 0) {
+		printf("\nFile and memory are identical.\n");
+		return 0;
+	}
+	fflush(stdout);
+	eprintf("\nFirst difference found at address 0x%05x\n",
+		map.ranges[0].start);
+	for (uint32_t i = 0; i < map.count; ++i)
+		eprintf("0x%05x-0x%05x differs%s\n", map.ranges[i].start,
+			map.ranges[i].start + map.ranges[i].size - 1,
+			map.ranges[i].erase ? ", needs an erase" : "");
+	eprintf("%u difference(s) found in %u range(s)%s\n", map.diffs,
+		map.count, map.count == MAX_DIFF_RANGES ? ", the last one "
+		"covers the rest" : "");
+	return 1;
+}
+
 static int compare_bios()
 {
-	uint8_t expect[BIOS_SIZE], actual[BIOS_SIZE];
+	uint8_t expect[BIOS_SIZE];
 	ssize_t file_size = load_bios_file(expect);
-	const uint32_t one_percent = file_size / 100;
+	uint32_t first_diff, diffs;
 
 	if (file_size <= 0)
 		return 1;
 
 	printf("Comparing memory and file '%s'\n", g_cfg.file_path);
 
-	if (init_read_mode()) {
+	/* Everything is compared, the transport may tell where it differs */
+	if (g_cfg.max_diffs == 0) {
+		int r = list_diffs(expect, file_size);
+
+		if (r >= 0)
+			return r;
+	}
+	if (init_read_mode_at(g_cfg.offset)) {
 		eprintf("Error while initializing the chip for reading\n");
 		return 1;
 	}
 
-	if (use_serial()) {
-		if (serial_read_byte_stream(actual, file_size))
-			return 1;
-		if (memcmp(expect, actual, file_size)) {
-			size_t i = 0;
-
-			while (expect[i] == actual[i] && i < (size_t) file_size)
-				++i;
-			if (i < (size_t) file_size) {
-				fflush(stdout);
-				eprintf("\nFirst difference found at address "
-					"0x%05zx\n", i);
-				return 1;
-			}
-		}
+	if (compare_chip(expect, file_size, g_cfg.max_diffs, &first_diff,
+			 &diffs)) {
+		fflush(stdout);
+		eprintf("\nError while reading from the chip.\n");
+		return 1;
 	}
+	if (first_diff < (uint32_t) file_size) {
+		fflush(stdout);
+		eprintf("\nFirst difference found at address 0x%05x\n",
+			g_cfg.offset + first_diff);
+		if (g_cfg.max_diffs != 1)
+			eprintf("%u difference(s) found%s\n", diffs,
+				diffs == g_cfg.max_diffs ? " (stopped early)"
+							 : "");
+		return 1;
+	}
+	printf("\nFile and memory are identical.\n");
+	return 0;
+}
 
-	for (uint32_t i = 0; !use_serial() && i < (uint32_t) file_size; ++i) {
-		uint8_t data = 0;
+static int verify_bios()
+{
+	uint8_t expect[BIOS_SIZE];
+	bool bad[BIOS_SIZE / VERIFY_BLOCK_SZ];
+	ssize_t file_size = load_bios_file(expect);
+	int bad_blocks;
 
-		if (read_byte(&data)) {
-			eprintf("Error while reading from the chip.\n");
-			return 1;
-		}
-		if (data != expect[i]) {
-			eprintf("First difference found at address 0x%x\n", i);
-			return 1;
-		}
-		if (i % one_percent == 0) {
-			printf("\r%02u%% done", i / one_percent);
-			fflush(stdout);
-		}
+	if (file_size <= 0)
+		return 1;
+
+	printf("Verifying memory against file '%s'\n", g_cfg.file_path);
+
+	bad_blocks = find_bad_blocks(expect, g_cfg.offset, file_size, bad);
+	if (bad_blocks < 0)
+		return 1;
+	for (uint32_t i = 0; i < (uint32_t) file_size; i += VERIFY_BLOCK_SZ) {
+		uint32_t size = file_size - i < VERIFY_BLOCK_SZ ? file_size - i
+			: VERIFY_BLOCK_SZ;
+
+		if (bad[i / VERIFY_BLOCK_SZ])
+			eprintf("Block 0x%05x-0x%05x differs\n",
+				g_cfg.offset + i, g_cfg.offset + i + size - 1);
 	}
-	printf("\nFile and memory are identical.\n");
+	if (bad_blocks) {
+		eprintf("%d block(s) differ, use -c with -o and -l to find "
+			"the differences in a block\n", bad_blocks);
+		return 1;
+	}
+	printf("File and memory checksums match.\n");
 	return 0;
 }
 
-static void set_operation(enum operation op, const char *file, const char *prog)
+static const char *device_name()
+{
+	static _Thread_local char port[8];
+
+	/* Still known once the device is closed */
+	if (g_cfg.serial_dev[0])
+		return g_cfg.serial_dev;
+	if (g_cfg.sim_spec[0])
+		return g_cfg.sim_spec;
+	snprintf(port, sizeof(port), "0x%x", g_cfg.port);
+	return port;
+}
+
+/* Timing files hold one "<device> <spin_us>" line per device */
+static int load_handshake_timing(uint32_t *spin_us)
+{
+	char dev[256];
+	unsigned int spin;
+	FILE *f = fopen(g_cfg.timing_path, "r");
+
+	if (!f)
+		return 1;
+	while (fscanf(f, "%255s %u", dev, &spin) == 2) {
+		if (strcmp(dev, device_name()) == 0) {
+			fclose(f);
+			*spin_us = spin;
+			return 0;
+		}
+	}
+	fclose(f);
+	return 1;
+}
+
+static void save_handshake_timing(uint32_t spin_us)
+{
+	FILE *f = fopen(g_cfg.timing_path, "a");
+
+	if (!f) {
+		eprintf("Couldn't save handshake timing to '%s'\n",
+			g_cfg.timing_path);
+		return;
+	}
+	fprintf(f, "%s %u\n", device_name(), spin_us);
+	fclose(f);
+}
+
+static void apply_handshake_timing(uint32_t spin_us)
+{
+	if (g_cfg.transport->set_spin)
+		g_cfg.transport->set_spin(spin_us);
+	else
+		g_cfg.spin_us = spin_us;
+}
+
+static int init_chip()
+{
+	outp(chip_io(), CMD_RESET);
+	return outp_seq(chip_io(), CMD_CHIP_INIT, sizeof(CMD_CHIP_INIT));
+}
+
+static void setup_handshake()
+{
+	struct ack_stats stats;
+	struct timespec start;
+	uint32_t spin_us;
+	int r;
+
+	if (g_cfg.timing_path[0] && load_handshake_timing(&spin_us) == 0) {
+		apply_handshake_timing(spin_us);
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	r = calibrate_handshake(&stats);
+	/* Older bridges can't, they keep their own timings */
+	if (r < 0)
+		return;
+	stats_phase(PHASE_CALIBRATE, 0, &start);
+	printf("Calibrating handshake... ");
+	if (r) {
+		printf("Failed, using default timings\n");
+	} else {
+		printf("ACK p50 %.1fus p99 %.1fus max %.1fus, spinning %uus\n",
+		       stats.p50_ns / 1000., stats.p99_ns / 1000.,
+		       stats.max_ns / 1000., stats.spin_us);
+		apply_handshake_timing(stats.spin_us);
+		if (g_cfg.timing_path[0])
+			save_handshake_timing(stats.spin_us);
+	}
+	/* Calibration left the chip in read mode */
+	init_chip();
+}
+
+static int set_operation(enum operation op, const char *file)
 {
 	if (g_cfg.operation != OP_UNSET)
-		usage_exit(prog, EXIT_FAILURE);
+		return 1;
 	g_cfg.operation = op;
 	if (strlen(file) >= sizeof(g_cfg.file_path)) {
-		eprintf("File path is too long");
-		exit(EXIT_FAILURE);
+		eprintf("File path is too long\n");
+		return 1;
+	}
+	strncpy(g_cfg.file_path, file, sizeof(g_cfg.file_path) - 1);
+	return 0;
+}
+
+/* Dumps go to all the files given with -r */
+static int add_copy(const char *file)
+{
+	if (g_cfg.copies == MAX_DUMP_FILES - 1) {
+		eprintf("Too many files to dump to\n");
+		return 1;
+	}
+	if (strlen(file) >= sizeof(g_cfg.copy_paths[0])) {
+		eprintf("File path is too long\n");
+		return 1;
+	}
+	strcpy(g_cfg.copy_paths[g_cfg.copies++], file);
+	return 0;
+}
+
+/* Options of the operation itself, the ones daemon jobs can be given */
+#define JOB_OPTIONS "m:do:l:R:fbVr:w:c:v:"
+
+static int parse_job_option(int opt, const char *arg)
+{
+	char *endptr;
+	unsigned long int val;
+
+	switch (opt) {
+	case 'm':
+		val = strtoul(arg, &endptr, 10);
+		if (*endptr != '\0' || val > BIOS_SIZE)
+			return 1;
+		g_cfg.max_diffs = (uint32_t) val;
+		break;
+	case 'd':
+		g_cfg.delta = true;
+		break;
+	case 'f':
+		g_cfg.fast = true;
+		break;
+	case 'b':
+		g_cfg.blank_check = true;
+		break;
+	case 'V':
+		g_cfg.verify_written = true;
+		break;
+	case 'o':
+	case 'l':
+		val = strtoul(arg, &endptr, 0);
+		if (*endptr != '\0' || val > BIOS_SIZE)
+			return 1;
+		if (opt == 'o')
+			g_cfg.offset = (uint32_t) val;
+		else
+			g_cfg.length = (uint32_t) val;
+		break;
+	case 'R':
+		val = strtoul(arg, &endptr, 0);
+		if (*endptr != '\0' || val >= BIOS_SIZE)
+			return 1;
+		g_cfg.resume = true;
+		g_cfg.resume_at = (uint32_t) val;
+		break;
+	case 'r':
+		if (g_cfg.operation == OP_READ)
+			return add_copy(arg);
+		return set_operation(OP_READ, arg);
+	case 'w':
+		return set_operation(OP_WRITE, arg);
+	case 'c':
+		return set_operation(OP_COMPARE, arg);
+	case 'v':
+		return set_operation(OP_VERIFY, arg);
+	default:
+		return 1;
+	}
+	return 0;
+}
+
+static int check_job(void)
+{
+	if (g_cfg.offset + g_cfg.length > BIOS_SIZE
+	    || g_cfg.offset == BIOS_SIZE) {
+		eprintf("The range to access doesn't fit on the chip\n");
+		return 1;
+	}
+	if (g_cfg.verify_written && g_cfg.operation != OP_WRITE) {
+		eprintf("-V verifies what -w wrote\n");
+		return 1;
 	}
-	strncpy(g_cfg.file_path, file, sizeof(g_cfg.file_path));
+	return 0;
 }
 
 static void process_config(int argc, char **argv)
 {
 	int opt;
 
-	while ((opt = getopt(argc, argv, "up:s:r:w:c:h")) != -1) {
+	while ((opt = getopt(argc, argv, "up:s:E:t:B:j:LD:S:Th" JOB_OPTIONS)) != -1) {
 		switch (opt) {
 		case 'u':
 			g_cfg.safe_mode = false;
@@ -397,40 +1004,256 @@ static void process_config(int argc, char **argv)
 			break;
 		}
 		case 's':
+			if (g_device_count == MAX_DEVICES) {
+				eprintf("Too many devices\n");
+				exit(EXIT_FAILURE);
+			}
+			g_devices[g_device_count++] = optarg;
 			strncpy(g_cfg.serial_dev, optarg,
 				sizeof(g_cfg.serial_dev) - 1);
 			break;
-		case 'r':
-			set_operation(OP_READ, optarg, argv[0]);
+		case 'E':
+			if (strlen(optarg) >= sizeof(g_cfg.sim_spec))
+				usage_exit(argv[0], EXIT_FAILURE);
+			strcpy(g_cfg.sim_spec, optarg);
+			break;
+		case 't':
+			strncpy(g_cfg.timing_path, optarg,
+				sizeof(g_cfg.timing_path) - 1);
 			break;
-		case 'w':
-			set_operation(OP_WRITE, optarg, argv[0]);
+		case 'B': {
+			char *endptr;
+			unsigned long int val;
+
+			val = strtoul(optarg, &endptr, 10);
+			if (*endptr != '\0' || val > UINT32_MAX)
+				usage_exit(argv[0], EXIT_FAILURE);
+			g_cfg.max_baud = (uint32_t) val;
 			break;
-		case 'c':
-			set_operation(OP_COMPARE, optarg, argv[0]);
+		}
+		case 'j':
+			g_stats_path = optarg;
+			break;
+		case 'L':
+			g_cfg.low_latency = true;
+			break;
+		case 'D':
+			g_daemon_socket = optarg;
+			break;
+		case 'S':
+			g_submit_socket = optarg;
+			break;
+		case 'T':
+			if (g_cfg.operation != OP_UNSET)
+				usage_exit(argv[0], EXIT_FAILURE);
+			g_cfg.operation = OP_LINK_TEST;
 			break;
 		case 'h':
 			usage_exit(argv[0], EXIT_SUCCESS);
 			break;
 		default:
-			usage_exit(argv[0], EXIT_FAILURE);
+			if (parse_job_option(opt, optarg))
+				usage_exit(argv[0], EXIT_FAILURE);
 		}
 	}
-	if (g_cfg.operation == OP_UNSET)
+	/* The daemon gets its operations from the jobs */
+	if ((g_cfg.operation == OP_UNSET) != (g_daemon_socket != NULL)
+	    || (g_daemon_socket && g_submit_socket))
 		usage_exit(argv[0], EXIT_FAILURE);
+	if (check_job())
+		exit(EXIT_FAILURE);
+	if (g_device_count && g_cfg.sim_spec[0]) {
+		eprintf("The simulator replaces the devices, -E can't be "
+			"used with -s\n");
+		exit(EXIT_FAILURE);
+	}
+	if (g_device_count > 1 && g_cfg.operation == OP_READ) {
+		eprintf("Only one device can be read at a time\n");
+		exit(EXIT_FAILURE);
+	}
+	if (g_cfg.operation == OP_LINK_TEST
+	    && (g_device_count != 1 || g_submit_socket)) {
+		eprintf("The link test runs on the serial device given with "
+			"-s, outside of the daemon\n");
+		exit(EXIT_FAILURE);
+	}
+	if (g_device_count > 1 && g_submit_socket) {
+		eprintf("A job runs on a single device of the daemon\n");
+		exit(EXIT_FAILURE);
+	}
 }
 
-int main(int argc, char **argv)
+/* Applies the options of a daemon job to the configuration of its device */
+static int parse_job(int argc, char **argv)
 {
-	process_config(argc, argv);
+	int opt;
+
+	optind = 0;
+	opterr = 0;
+	while ((opt = getopt(argc, argv, "s:" JOB_OPTIONS)) != -1) {
+		/* The daemon already picked the device of the job */
+		if (opt != 's' && parse_job_option(opt, optarg)) {
+			eprintf("Invalid job option -%c\n", optopt ? optopt
+								       : opt);
+			return 1;
+		}
+	}
+	if (g_cfg.operation == OP_UNSET) {
+		eprintf("No operation given\n");
+		return 1;
+	}
+	if (check_job())
+		return 1;
+	return needs_image() && load_image();
+}
+
+/* The daemon doesn't run in the directory of the client */
+static void absolute_path(char *path, const char *file)
+{
+	path[0] = '\0';
+	if (file[0] != '/' && getcwd(path, PATH_MAX))
+		strcat(path, "/");
+	strcat(path, file);
+}
+
+static int submit_job(void)
+{
+	static const char *const OPERATIONS[] = {
+		[OP_READ] = "-r",
+		[OP_WRITE] = "-w",
+		[OP_COMPARE] = "-c",
+		[OP_VERIFY] = "-v",
+	};
+	char paths[MAX_DUMP_FILES][PATH_MAX + sizeof(g_cfg.file_path)];
+	char values[4][16];
+	const char *args[24];
+	unsigned int n = 0;
+
+	absolute_path(paths[0], g_cfg.file_path);
+	args[n++] = OPERATIONS[g_cfg.operation];
+	args[n++] = paths[0];
+	for (unsigned int i = 0; i < g_cfg.copies; ++i) {
+		absolute_path(paths[i + 1], g_cfg.copy_paths[i]);
+		args[n++] = "-r";
+		args[n++] = paths[i + 1];
+	}
+	if (g_device_count) {
+		args[n++] = "-s";
+		args[n++] = g_cfg.serial_dev;
+	}
+	if (g_cfg.max_diffs != 1) {
+		snprintf(values[0], sizeof(values[0]), "%u", g_cfg.max_diffs);
+		args[n++] = "-m";
+		args[n++] = values[0];
+	}
+	if (g_cfg.offset) {
+		snprintf(values[1], sizeof(values[1]), "0x%x", g_cfg.offset);
+		args[n++] = "-o";
+		args[n++] = values[1];
+	}
+	if (g_cfg.length) {
+		snprintf(values[2], sizeof(values[2]), "0x%x", g_cfg.length);
+		args[n++] = "-l";
+		args[n++] = values[2];
+	}
+	if (g_cfg.resume) {
+		snprintf(values[3], sizeof(values[3]), "0x%x",
+			 g_cfg.resume_at);
+		args[n++] = "-R";
+		args[n++] = values[3];
+	}
+	if (g_cfg.delta)
+		args[n++] = "-d";
+	if (g_cfg.fast)
+		args[n++] = "-f";
+	if (g_cfg.blank_check)
+		args[n++] = "-b";
+	if (g_cfg.verify_written)
+		args[n++] = "-V";
+	return daemon_submit(g_submit_socket, args, n);
+}
+
+/*
+ * The chip is verified with the image already in memory and the device still
+ * open, with the checksums of the bridge if it can compute them
+ */
+static int write_verify_bios()
+{
+	if (write_bios())
+		return 1;
+	if (use_serial() ? serial_for_each_module(verify_bios)
+			 : verify_bios()) {
+		eprintf("Write and verify failed\n");
+		return 1;
+	}
+	printf("Write and verify passed.\n");
+	return 0;
+}
 
-	/* Use parallel port if Serial hasn't been initialized */
-	if (!g_cfg.serial_dev[0] && ioperm(g_cfg.port, 2, 1)) {
-		eprintf("Unable to acquire permissions for port 0x%x, give "
-			"yourself permission or try running as root.\n",
-			g_cfg.port);
+/*
+ * Writes go to all the modules of a multi-module bridge at once, what reads
+ * the chip would only get the first one
+ */
+static int check_modules()
+{
+	if (!use_serial() || serial_module_count() < 2
+	    || g_cfg.operation == OP_UNSET || g_cfg.operation == OP_LINK_TEST)
+		return 0;
+	if (g_cfg.operation == OP_WRITE && !g_cfg.delta && !windowed()
+	    && !g_cfg.fast && !g_cfg.blank_check)
+		return 0;
+	fflush(stdout);
+	eprintf("Several modules can only be written with -w (and -V), "
+		"without -d, -o, -l, -f or -b\n");
+	return 1;
+}
+
+static int run_operation()
+{
+	switch (g_cfg.operation) {
+	case OP_READ:
+		return read_bios();
+	case OP_WRITE:
+		return g_cfg.verify_written ? write_verify_bios() : write_bios();
+	case OP_COMPARE:
+		return compare_bios();
+	case OP_VERIFY:
+		return verify_bios();
+	case OP_LINK_TEST:
+		return serial_link_test();
+	default:
+		return 1;
+	}
+}
+
+static void close_device()
+{
+	if (g_cfg.transport->close)
+		g_cfg.transport->close();
+}
+
+/*
+ * Opens the device and gets the chip ready for an operation, nothing stays
+ * open on failure
+ */
+static int open_device()
+{
+	stats_reset();
+	if (g_cfg.low_latency)
+		realtime_enter(g_device_count > 1);
+	/* Use parallel port if no serial device was given */
+	if (g_cfg.sim_spec[0])
+		g_cfg.transport = &sim_transport;
+	else if (g_cfg.serial_dev[0])
+		g_cfg.transport = &serial_transport;
+	else
+		g_cfg.transport = &parallel_transport;
+	if (g_cfg.transport->init())
 		return EXIT_FAILURE;
-	} else if (g_cfg.serial_dev[0] && serial_init()) {
+	if (g_cfg.operation == OP_LINK_TEST)
+		return 0;
+	if (check_modules()) {
+		close_device();
 		return EXIT_FAILURE;
 	}
 
@@ -441,21 +1264,77 @@ int main(int argc, char **argv)
 	}
 
 	/* Init Viper GC chip */
-	outp(CMD_RESET);
-	if (outp(CMD_CHIP_INIT[0]) || outp(CMD_CHIP_INIT[1])
-	    || outp(CMD_CHIP_INIT[2])) {
+	if (init_chip()) {
 		eprintf("Viper GC not found.\n");
+		close_device();
 		return EXIT_FAILURE;
 	}
+	/*
+	 * Only the Arduino polls ACKs when safe mode is disabled, fast mode
+	 * paces pentads with the calibrated timings
+	 */
+	if (g_cfg.safe_mode || g_cfg.fast || g_cfg.transport->calibrate)
+		setup_handshake();
+	return 0;
+}
 
-	switch (g_cfg.operation) {
-		case OP_READ:
-			return read_bios();
-		case OP_WRITE:
-			return write_bios();
-		case OP_COMPARE:
-			return compare_bios();
-		default:
-			usage_exit(argv[0], EXIT_FAILURE);
+/* Daemon jobs leave the device open, with nothing left in its queue */
+static int run_job()
+{
+	int r;
+
+	/* Not the time the device waited for the job */
+	stats_reset();
+	r = check_modules() || run_operation();
+	if (g_cfg.transport->flush)
+		g_cfg.transport->flush();
+	stats_dump(device_name(), r);
+	return r;
+}
+
+/* After a failed job, whether the device still answers */
+static int check_device()
+{
+	return init_chip();
+}
+
+/* Everything that happens on one device, in its own thread in farm mode */
+static int run_device()
+{
+	int r;
+
+	if (open_device()) {
+		stats_dump(device_name(), EXIT_FAILURE);
+		return EXIT_FAILURE;
 	}
+	r = run_operation();
+	close_device();
+	stats_dump(device_name(), r);
+	return r;
+}
+
+int main(int argc, char **argv)
+{
+	static const struct daemon_ops DAEMON_OPS = {
+		.open = open_device,
+		.parse = parse_job,
+		.run = run_job,
+		.check = check_device,
+		.close = close_device,
+	};
+
+	process_config(argc, argv);
+
+	if (g_submit_socket)
+		return submit_job();
+	if (g_stats_path && stats_open(g_stats_path))
+		return EXIT_FAILURE;
+	if (g_daemon_socket)
+		return daemon_run(&g_cfg, g_daemon_socket, g_devices,
+				  g_device_count, &DAEMON_OPS);
+	if (needs_image() && load_image())
+		return EXIT_FAILURE;
+	if (g_device_count > 1)
+		return farm_run(&g_cfg, g_devices, g_device_count, run_device);
+	return run_device();
 }
@@ -0,0 +1,178 @@
+#include <string.h>
+#include <time.h>
+
+#include "viper_sim.h"
+
+/*
+ * The model follows the pentad protocol of viper_gc.h from the chip side:
+ * every rising edge of D4 (the strobe) latches a pentad, pin 15 goes high
+ * ack_latency_ns after the strobe goes low and low again the same time after
+ * it goes back high. Reads shift the byte out on pin 13 least significant
+ * bit first, one bit per ACK pentad.
+ */
+
+#define SIM_CMD_ERASE		0x03
+#define SIM_CMD_WRITE_BYTE	0x05
+#define SIM_CMD_READ		0x0d
+#define SIM_CMD_READ_INIT	0x11
+#define SIM_CMD_CHIP_INIT	0x1f	/* 0xff, as the chip sees it */
+#define SIM_STALL_NS		20000000
+
+enum sim_state {
+	SIM_IDLE,
+	SIM_CHIP_INIT,
+	SIM_READ_INIT,
+	SIM_READ,
+	SIM_WRITE,
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void viper_sim_init(struct viper_sim *s)
+{
+	memset(s, 0, sizeof(*s));
+	memset(s->flash, 0xff, sizeof(s->flash));
+	s->ack_latency_ns = 2000;
+	s->erase_ms = 200;
+	s->port = 0x10;
+}
+
+static bool erasing(const struct viper_sim *s)
+{
+	return s->erase_until && now_ns() < s->erase_until;
+}
+
+static bool stalled(const struct viper_sim *s)
+{
+	return s->stall_until && now_ns() < s->stall_until;
+}
+
+/* Address on 17 bits, laid out like in write_byte() */
+static uint32_t args_address(const struct viper_sim *s)
+{
+	return ((uint32_t) (s->args[0] & 0x3) << 15)
+		| ((uint32_t) s->args[1] << 10)
+		| ((uint32_t) s->args[2] << 5) | s->args[3];
+}
+
+static void command(struct viper_sim *s, uint8_t p)
+{
+	if (p != SIM_CMD_ERASE)
+		s->erase_cmds = 0;
+	s->nargs = 0;
+
+	switch (p) {
+	case SIM_CMD_ERASE:
+		if (++s->erase_cmds < 13)
+			break;
+		s->erase_cmds = 0;
+		memset(s->flash, 0xff, sizeof(s->flash));
+		s->erase_until = now_ns() + (uint64_t) s->erase_ms * 1000000;
+		break;
+	case SIM_CMD_WRITE_BYTE:
+		++s->writes;
+		if (s->fail_write && s->writes == s->fail_write) {
+			s->stall_until = now_ns() + SIM_STALL_NS;
+			break;
+		}
+		s->dropping = s->drop_write && s->writes == s->drop_write;
+		s->state = SIM_WRITE;
+		break;
+	case SIM_CMD_READ_INIT:
+		s->state = SIM_READ_INIT;
+		break;
+	case SIM_CMD_CHIP_INIT:
+		s->state = SIM_CHIP_INIT;
+		break;
+	case SIM_CMD_READ:
+		/* The data toggles while erasing */
+		if (erasing(s)) {
+			s->toggle = !s->toggle;
+			s->out = s->toggle ? 0x40 : 0x00;
+		} else {
+			s->out = s->flash[s->address];
+		}
+		s->address = (s->address + 1) & 0x1ffff;
+		s->bit = 0;
+		s->sel = s->out & 1;
+		s->state = SIM_READ;
+		break;
+	default:
+		break;
+	}
+}
+
+static void pentad(struct viper_sim *s, uint8_t p)
+{
+	switch (s->state) {
+	case SIM_IDLE:
+		command(s, p);
+		break;
+	case SIM_CHIP_INIT:
+		if (++s->nargs == 2)
+			s->state = SIM_IDLE;
+		break;
+	case SIM_READ_INIT:
+		s->args[s->nargs++] = p;
+		/* Whether the chip does that is unknown, both are modeled */
+		if (s->nargs == 4) {
+			s->address = s->seed_read ? args_address(s) : 0;
+			s->state = SIM_IDLE;
+		}
+		break;
+	case SIM_READ:
+		if (++s->bit == 8)
+			s->state = SIM_IDLE;
+		else
+			s->sel = (s->out >> s->bit) & 1;
+		break;
+	case SIM_WRITE:
+		s->args[s->nargs++] = p;
+		if (s->nargs < 8)
+			break;
+		/* Programming can only clear bits */
+		if (!erasing(s) && !s->dropping)
+			s->flash[args_address(s)] &= ((s->args[0] & 0x1c) << 3)
+				| s->args[4];
+		s->state = SIM_IDLE;
+		break;
+	}
+}
+
+/* A stalled chip stops ACKing and ignores everything it is sent */
+static void settle(struct viper_sim *s)
+{
+	if (!stalled(s) && s->err != s->pending_err && now_ns() >= s->ack_at)
+		s->err = s->pending_err;
+}
+
+void viper_sim_outb(struct viper_sim *s, uint8_t data)
+{
+	uint8_t prev = s->port;
+
+	s->port = data & 0x3f;
+	settle(s);
+	if (stalled(s))
+		return;
+	if ((prev & 0x10) && !(s->port & 0x10)) {
+		s->pending_err = true;
+		s->ack_at = now_ns() + s->ack_latency_ns;
+	} else if (!(prev & 0x10) && (s->port & 0x10)) {
+		/* D5 carries the fifth bit of the pentad */
+		pentad(s, (s->port & 0xf) | (s->port & 0x20) >> 1);
+		s->pending_err = false;
+		s->ack_at = now_ns() + s->ack_latency_ns;
+	}
+}
+
+uint8_t viper_sim_status(struct viper_sim *s)
+{
+	settle(s);
+	return (s->sel ? 0x10 : 0) | (s->err ? 0x08 : 0);
+}
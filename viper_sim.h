@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Software model of the Viper GC parallel module, driven like the pins of
+ * the parallel port: outb() sets D0-D5 and status() returns pin 13 (data)
+ * and pin 15 (ACK) laid out like the status register. It is plain C so that
+ * the bridge emulator can run the sketch on top of it too.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct viper_sim {
+	uint8_t flash[0x20000];
+	uint32_t ack_latency_ns; /* Between a strobe edge and its ACK */
+	uint32_t erase_ms;
+	uint32_t fail_write; /* Nth write command is lost and the chip stalls */
+	uint32_t drop_write; /* Nth write command is silently ignored */
+	uint32_t seed_read; /* The pentads after READ_INIT set the address */
+
+	/* Internal state */
+	uint8_t port;
+	int state;
+	uint8_t args[8];
+	uint8_t nargs;
+	uint8_t erase_cmds;
+	uint32_t address;
+	uint8_t out, bit;
+	bool sel, err, pending_err;
+	bool toggle, dropping;
+	uint32_t writes;
+	uint64_t ack_at, erase_until, stall_until;
+};
+
+void viper_sim_init(struct viper_sim *s);
+void viper_sim_outb(struct viper_sim *s, uint8_t data);
+uint8_t viper_sim_status(struct viper_sim *s);
+
+#ifdef __cplusplus
+}
+#endif